@@ -1,19 +1,87 @@
 #include <QDebug>
 #include <QApplication>
+#include <QDateTime>
 #include <QDir>
+#include <QFile>
 #include <QDBusError>
 #include <QDBusConnection>
 #include <QDBusAbstractAdaptor>
+#include <QDBusContext>
+#include <QDBusMessage>
 #include <QDBusMetaType>
+#include <QDBusObjectPath>
+#include <QFileInfo>
+#include <QHash>
+#include <QRunnable>
+#include <QThread>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVariant>
 
 #include "kdiskmanager.hpp"
 
+// calls for multiple devices are replied to once the operations of all devices are done
+struct KBlockdBatch {
+    QDBusMessage message;
+    int pending;
+    QVariantMap results;
+};
+
+// privileged operation on a single device, runs in the worker pool of the adaptor
+class KBlockdOperation : public QObject, public QRunnable {
+    Q_OBJECT
+
+    public:
+        enum KOperationType {
+            Mount = 0,
+            Unmount = 1,
+            Trim = 2,
+            SetQueueParameter = 3,
+            MountImage = 4
+        };
+
+        KBlockdOperation(const KOperationType type, const QString &device, const KDiskInfo &disk,
+            const QStringList &arguments);
+
+        // reimplementation
+        void run();
+
+        const KOperationType m_type;
+        // the device as named by the caller
+        const QString m_name;
+        /*
+            operations with the same device are serialized, block devices are keyed by name and
+            images by their canonical path so that they never collide with each other
+        */
+        const QString m_device;
+        const KDiskInfo m_disk;
+        const QStringList m_arguments;
+        QDBusMessage m_message;
+        KBlockdBatch *m_batch;
+        QVariant m_result;
+
+    Q_SIGNALS:
+        void finished();
+};
+
+/*
+    the object registered on the bus, QtDBus sets the context of the calls on the parent of the
+    adaptor so that is where QDBusContext must be
+*/
+class KBlockdObject : public QObject, public QDBusContext {
+    Q_OBJECT
+
+    public:
+        KBlockdObject(QObject *parent);
+};
+
 class KBlockdInterfaceAdaptor: public QDBusAbstractAdaptor {
     Q_OBJECT
     Q_CLASSINFO("D-Bus Interface", "com.kblockd.Block")
     Q_CLASSINFO("D-Bus Introspection",
 "  <interface name=\"com.kblockd.Block\">\n"
 "    <property name=\"disks\" type=\"a(ssssii)\" access=\"read\"/>\n"
+"    <property name=\"disksV2\" type=\"a(ssssiixiiiiib)\" access=\"read\"/>\n"
 "    <property name=\"supported\" type=\"a(s)\" access=\"read\"/>\n"
 "    <method name=\"rescan\">\n"
 "      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
@@ -23,6 +91,11 @@ class KBlockdInterfaceAdaptor: public QDBusAbstractAdaptor {
 "      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
 "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfo\"/>\n"
 "    </method>\n"
+"    <method name=\"infoV2\">\n"
+"      <arg name=\"result\" type=\"(ssssiixiiiiib)\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfoV2\"/>\n"
+"    </method>\n"
 "    <method name=\"unmount\">\n"
 "      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
 "      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
@@ -31,8 +104,129 @@ class KBlockdInterfaceAdaptor: public QDBusAbstractAdaptor {
 "      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
 "      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
 "    </method>\n"
+"    <method name=\"mountWithOptions\">\n"
+"      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"options\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"trim\">\n"
+"      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"mountImage\">\n"
+"      <arg name=\"device\" type=\"s\" direction=\"out\"/>\n"
+"      <arg name=\"path\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"options\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"capabilities\">\n"
+"      <arg name=\"capabilities\" type=\"a{sv}\" direction=\"out\"/>\n"
+"    </method>\n"
+"    <method name=\"metrics\">\n"
+"      <arg name=\"metrics\" type=\"s\" direction=\"out\"/>\n"
+"    </method>\n"
+"    <method name=\"infoMany\">\n"
+"      <arg name=\"result\" type=\"a(ssssii)\" direction=\"out\"/>\n"
+"      <arg name=\"disks\" type=\"as\" direction=\"in\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QList&lt;KDiskInfo&gt;\"/>\n"
+"    </method>\n"
+"    <method name=\"mountMany\">\n"
+"      <arg name=\"results\" type=\"a{sv}\" direction=\"out\"/>\n"
+"      <arg name=\"disks\" type=\"as\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"unmountMany\">\n"
+"      <arg name=\"results\" type=\"a{sv}\" direction=\"out\"/>\n"
+"      <arg name=\"disks\" type=\"as\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"usage\">\n"
+"      <arg name=\"result\" type=\"a(ssxxxxxx)\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QList&lt;KDiskUsage&gt;\"/>\n"
+"    </method>\n"
+"    <method name=\"rescanJob\">\n"
+"      <arg name=\"job\" type=\"o\" direction=\"out\"/>\n"
+"    </method>\n"
+"    <method name=\"fsckJob\">\n"
+"      <arg name=\"job\" type=\"o\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"mkfsJob\">\n"
+"      <arg name=\"job\" type=\"o\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"fstype\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"changes\">\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"since\" type=\"u\" direction=\"in\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"changed\" type=\"a(ssssii)\" direction=\"out\"/>\n"
+"      <arg name=\"removed\" type=\"as\" direction=\"out\"/>\n"
+"      <arg name=\"current\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out1\" value=\"QList&lt;KDiskInfo&gt;\"/>\n"
+"    </method>\n"
+"    <method name=\"changesV2\">\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"since\" type=\"u\" direction=\"in\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"changed\" type=\"a(ssssiixiiiiib)\" direction=\"out\"/>\n"
+"      <arg name=\"parents\" type=\"as\" direction=\"out\"/>\n"
+"      <arg name=\"removed\" type=\"as\" direction=\"out\"/>\n"
+"      <arg name=\"current\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out1\" value=\"QList&lt;KDiskInfoV2&gt;\"/>\n"
+"    </method>\n"
+"    <method name=\"stats\">\n"
+"      <arg name=\"result\" type=\"a(sxdddddd)\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QList&lt;KDiskStats&gt;\"/>\n"
+"    </method>\n"
+"    <method name=\"queueParameter\">\n"
+"      <arg name=\"result\" type=\"s\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"parameter\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <method name=\"setQueueParameter\">\n"
+"      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
+"      <arg name=\"disk\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"parameter\" type=\"s\" direction=\"in\"/>\n"
+"      <arg name=\"value\" type=\"s\" direction=\"in\"/>\n"
+"    </method>\n"
+"    <signal name=\"diskAdded\">\n"
+"      <arg name=\"disk\" type=\"(ssssii)\" direction=\"out\"/>\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfo\"/>\n"
+"    </signal>\n"
+"    <signal name=\"diskChanged\">\n"
+"      <arg name=\"disk\" type=\"(ssssii)\" direction=\"out\"/>\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfo\"/>\n"
+"    </signal>\n"
+"    <signal name=\"diskRemoved\">\n"
+"      <arg name=\"disk\" type=\"(ssssii)\" direction=\"out\"/>\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfo\"/>\n"
+"    </signal>\n"
+"    <signal name=\"diskAddedV2\">\n"
+"      <arg name=\"disk\" type=\"(ssssiixiiiiib)\" direction=\"out\"/>\n"
+"      <arg name=\"parent\" type=\"s\" direction=\"out\"/>\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfoV2\"/>\n"
+"    </signal>\n"
+"    <signal name=\"diskChangedV2\">\n"
+"      <arg name=\"disk\" type=\"(ssssiixiiiiib)\" direction=\"out\"/>\n"
+"      <arg name=\"parent\" type=\"s\" direction=\"out\"/>\n"
+"      <arg name=\"generation\" type=\"u\" direction=\"out\"/>\n"
+"      <arg name=\"epoch\" type=\"s\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskInfoV2\"/>\n"
+"    </signal>\n"
+"    <signal name=\"usageThreshold\">\n"
+"      <arg name=\"usage\" type=\"(ssxxxxxx)\" direction=\"out\"/>\n"
+"      <arg name=\"threshold\" type=\"i\" direction=\"out\"/>\n"
+"      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"KDiskUsage\"/>\n"
+"    </signal>\n"
 "  </interface>\n")
     Q_PROPERTY(QList<KDiskInfo> disks READ disks)
+    Q_PROPERTY(QList<KDiskInfoV2> disksV2 READ disksV2)
     Q_PROPERTY(QStringList supported READ supported)
 
     public:
@@ -40,62 +234,663 @@ class KBlockdInterfaceAdaptor: public QDBusAbstractAdaptor {
         ~KBlockdInterfaceAdaptor();
 
         QList<KDiskInfo> disks() const;
+        QList<KDiskInfoV2> disksV2() const;
         QStringList supported() const;
 
     public Q_SLOTS:
-        bool rescan() const;
+        bool rescan();
         KDiskInfo info(const QString &disk) const;
-        bool mount(const QString &disk) const;
-        bool unmount(const QString &disk) const;
+        KDiskInfoV2 infoV2(const QString &disk) const;
+        bool mount(const QString &disk);
+        bool mountWithOptions(const QString &disk, const QString &options);
+        bool unmount(const QString &disk);
+        bool trim(const QString &disk);
+        QString mountImage(const QString &path, const QString &options);
+        QVariantMap capabilities() const;
+        QList<KDiskInfo> infoMany(const QStringList &disks) const;
+        QVariantMap mountMany(const QStringList &disks);
+        QVariantMap unmountMany(const QStringList &disks);
+        QDBusObjectPath rescanJob();
+        QDBusObjectPath fsckJob(const QString &disk);
+        QDBusObjectPath mkfsJob(const QString &disk, const QString &fstype);
+        uint changes(uint since, const QString &epoch, QList<KDiskInfo> &changed, QStringList &removed, QString &current) const;
+        uint changesV2(uint since, const QString &epoch, QList<KDiskInfoV2> &changed, QStringList &parents, QStringList &removed, QString &current) const;
+        QList<KDiskStats> stats() const;
+        QList<KDiskUsage> usage() const;
+        QString queueParameter(const QString &disk, const QString &parameter) const;
+        bool setQueueParameter(const QString &disk, const QString &parameter, const QString &value);
+        QString metrics() const;
+
+    Q_SIGNALS:
+        void diskAdded(const KDiskInfo &disk, uint generation, const QString &epoch);
+        void diskChanged(const KDiskInfo &disk, uint generation, const QString &epoch);
+        void diskRemoved(const KDiskInfo &disk, uint generation, const QString &epoch);
+        void diskAddedV2(const KDiskInfoV2 &disk, const QString &parent, uint generation, const QString &epoch);
+        void diskChangedV2(const KDiskInfoV2 &disk, const QString &parent, uint generation, const QString &epoch);
+        void usageThreshold(const KDiskUsage &usage, int threshold);
+
+    private Q_SLOTS:
+        void jobFinished();
+        void rescanFinished(bool result);
+        void operationFinished();
+        void trackAdded(const KDiskInfo &disk);
+        void trackChanged(const KDiskInfo &disk);
+        void trackRemoved(const KDiskInfo &disk);
+        void statsIdle();
+
+    private:
+        QDBusContext* context() const;
+        QDBusObjectPath exportJob(KDiskJob *job);
+        bool enqueue(KBlockdOperation *operation);
+        QVariantMap enqueueMany(const KBlockdOperation::KOperationType type, const QStringList &disks);
+        void schedule(KBlockdOperation *operation);
+        void track(const KDiskInfo &disk, const bool removed);
+
+        struct KBlockdChange {
+            uint generation;
+            KDiskInfo disk;
+            QString parent;
+            bool removed;
+        };
+        QList<KBlockdChange> changesSince(uint since, const QString &epoch) const;
+
+        int m_jobid;
+        KDiskManager *m_manager;
+        uint m_generation;
+        // generations are meaningful only within the same daemon instance
+        QString m_epoch;
+        // last change of every disk ever seen, removed disks are kept as tombstones
+        QHash<QByteArray, KBlockdChange> m_changes;
+        // pending operations of every device, the first one is running
+        QHash<QString, QList<KBlockdOperation*> > m_operations;
+        QThreadPool m_pool;
+        // messages of the calls waiting for rescan jobs
+        QHash<QObject*, QDBusMessage> m_rescans;
+        // sampling stops once nobody asked for the statistics for a while
+        QTimer *m_statsidle;
 };
 
+class KBlockdJobAdaptor: public QDBusAbstractAdaptor {
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "com.kblockd.Job")
+    Q_CLASSINFO("D-Bus Introspection",
+"  <interface name=\"com.kblockd.Job\">\n"
+"    <property name=\"completed\" type=\"b\" access=\"read\"/>\n"
+"    <property name=\"result\" type=\"b\" access=\"read\"/>\n"
+"    <property name=\"errorString\" type=\"s\" access=\"read\"/>\n"
+"    <property name=\"percent\" type=\"i\" access=\"read\"/>\n"
+"    <property name=\"eta\" type=\"i\" access=\"read\"/>\n"
+"    <property name=\"output\" type=\"s\" access=\"read\"/>\n"
+"    <signal name=\"progress\">\n"
+"      <arg name=\"percent\" type=\"i\" direction=\"out\"/>\n"
+"    </signal>\n"
+"    <signal name=\"error\">\n"
+"      <arg name=\"message\" type=\"s\" direction=\"out\"/>\n"
+"    </signal>\n"
+"    <signal name=\"finished\">\n"
+"      <arg name=\"result\" type=\"b\" direction=\"out\"/>\n"
+"    </signal>\n"
+"  </interface>\n")
+    Q_PROPERTY(bool completed READ completed)
+    Q_PROPERTY(bool result READ result)
+    Q_PROPERTY(QString errorString READ errorString)
+    Q_PROPERTY(int percent READ percent)
+    Q_PROPERTY(int eta READ eta)
+    Q_PROPERTY(QString output READ output)
+
+    public:
+        KBlockdJobAdaptor(KDiskJob *parent);
+        ~KBlockdJobAdaptor();
+
+        bool completed() const;
+        bool result() const;
+        QString errorString() const;
+        int percent() const;
+        int eta() const;
+        QString output() const;
+
+    Q_SIGNALS:
+        void progress(int percent);
+        void error(const QString &message);
+        void finished(bool result);
+
+    private:
+        KDiskJob *m_job;
+};
+
+// calls served are the number of observations of the histograms
+#define KBLOCKD_CALL_METRIC(variable, method) \
+    static KDiskMetric variable("kblockd_dbus_call_seconds", "Time to serve D-Bus call", \
+        KDiskMetric::Histogram, "method=\"" method "\"")
+
+KBLOCKD_CALL_METRIC(s_diskscalls, "disks");
+KBLOCKD_CALL_METRIC(s_disksv2calls, "disksV2");
+KBLOCKD_CALL_METRIC(s_supportedcalls, "supported");
+KBLOCKD_CALL_METRIC(s_rescancalls, "rescan");
+KBLOCKD_CALL_METRIC(s_infocalls, "info");
+KBLOCKD_CALL_METRIC(s_infov2calls, "infoV2");
+KBLOCKD_CALL_METRIC(s_mountcalls, "mount");
+KBLOCKD_CALL_METRIC(s_mountwithoptionscalls, "mountWithOptions");
+KBLOCKD_CALL_METRIC(s_unmountcalls, "unmount");
+KBLOCKD_CALL_METRIC(s_trimcalls, "trim");
+KBLOCKD_CALL_METRIC(s_mountimagecalls, "mountImage");
+KBLOCKD_CALL_METRIC(s_capabilitiescalls, "capabilities");
+KBLOCKD_CALL_METRIC(s_infomanycalls, "infoMany");
+KBLOCKD_CALL_METRIC(s_mountmanycalls, "mountMany");
+KBLOCKD_CALL_METRIC(s_unmountmanycalls, "unmountMany");
+KBLOCKD_CALL_METRIC(s_rescanjobcalls, "rescanJob");
+KBLOCKD_CALL_METRIC(s_fsckjobcalls, "fsckJob");
+KBLOCKD_CALL_METRIC(s_mkfsjobcalls, "mkfsJob");
+KBLOCKD_CALL_METRIC(s_changescalls, "changes");
+KBLOCKD_CALL_METRIC(s_changesv2calls, "changesV2");
+KBLOCKD_CALL_METRIC(s_statscalls, "stats");
+KBLOCKD_CALL_METRIC(s_usagecalls, "usage");
+KBLOCKD_CALL_METRIC(s_queueparametercalls, "queueParameter");
+KBLOCKD_CALL_METRIC(s_setqueueparametercalls, "setQueueParameter");
+KBLOCKD_CALL_METRIC(s_metricscalls, "metrics");
+
+#undef KBLOCKD_CALL_METRIC
+
+// I/O statistics sampling interval while there are consumers, 0 disables the statistics
+static int s_statsinterval = 1000;
+
+static QString operationKey(const KBlockdOperation::KOperationType type, const QString &device, const KDiskInfo &disk) {
+    if (type == KBlockdOperation::MountImage) {
+        const QFileInfo imageinfo(device);
+        const QString canonical = imageinfo.canonicalFilePath();
+        return canonical.isEmpty() ? imageinfo.absoluteFilePath() : canonical;
+    }
+    return QFileInfo(disk.isNull() ? device : QFile::decodeName(disk.name)).fileName();
+}
+
+KBlockdOperation::KBlockdOperation(const KOperationType type, const QString &device, const KDiskInfo &disk,
+    const QStringList &arguments)
+    : QObject(Q_NULLPTR),
+    m_type(type),
+    m_name(device),
+    m_device(operationKey(type, device, disk)),
+    m_disk(disk),
+    m_arguments(arguments),
+    m_batch(Q_NULLPTR),
+    m_result(false) {
+    // deleted by the adaptor once the reply has been sent
+    setAutoDelete(false);
+}
+
+void KBlockdOperation::run() {
+    switch (m_type) {
+        case KBlockdOperation::Mount: {
+            m_result = KDiskManager::mount(m_disk, QString(), m_arguments.value(0));
+            break;
+        }
+        case KBlockdOperation::Unmount: {
+            m_result = KDiskManager::unmount(m_disk);
+            break;
+        }
+        case KBlockdOperation::Trim: {
+            m_result = KDiskManager::trim(m_disk);
+            break;
+        }
+        case KBlockdOperation::SetQueueParameter: {
+            m_result = KDiskManager::setQueueParameter(m_arguments.at(0), m_arguments.at(1), m_arguments.at(2));
+            break;
+        }
+        case KBlockdOperation::MountImage: {
+            m_result = KDiskManager::mountImage(m_arguments.at(0), m_arguments.at(1));
+            break;
+        }
+    }
+    emit finished();
+}
+
+KBlockdObject::KBlockdObject(QObject *parent)
+    : QObject(parent) {
+}
+
 KBlockdInterfaceAdaptor::KBlockdInterfaceAdaptor(QObject *parent)
-    : QDBusAbstractAdaptor(parent) {
+    : QDBusAbstractAdaptor(parent),
+    m_jobid(0),
+    m_manager(Q_NULLPTR),
+    m_generation(1),
+    m_statsidle(Q_NULLPTR) {
+    // the boot and the start time identify the instance, generations restart from 1 with it
+    QFile bootid(QString::fromLatin1("/proc/sys/kernel/random/boot_id"));
+    if (bootid.open(QFile::ReadOnly)) {
+        m_epoch = QString::fromLatin1(bootid.readAll().trimmed());
+    }
+    m_epoch += QLatin1Char('-') + QString::number(QDateTime::currentMSecsSinceEpoch());
+
+    // the initial disks are generation 1, asking for changes since 0 returns all disks
+    foreach (const KDiskInfo &disk, KDiskManager::disks()) {
+        track(disk, false);
+    }
+
+    m_manager = new KDiskManager(this);
+    connect(m_manager, SIGNAL(added(KDiskInfo)), this, SLOT(trackAdded(KDiskInfo)));
+    connect(m_manager, SIGNAL(changed(KDiskInfo)), this, SLOT(trackChanged(KDiskInfo)));
+    connect(m_manager, SIGNAL(removed(KDiskInfo)), this, SLOT(trackRemoved(KDiskInfo)));
+    connect(m_manager, SIGNAL(usageThreshold(KDiskUsage,int)), this, SIGNAL(usageThreshold(KDiskUsage,int)));
+
+    // the operations wait for the devices rather than the processor
+    m_pool.setMaxThreadCount(qMax(QThread::idealThreadCount(), 4));
+
+    m_statsidle = new QTimer(this);
+    m_statsidle->setSingleShot(true);
+    m_statsidle->setInterval(5 * 60 * 1000);
+    connect(m_statsidle, SIGNAL(timeout()), this, SLOT(statsIdle()));
 }
 
 KBlockdInterfaceAdaptor::~KBlockdInterfaceAdaptor() {
+    m_pool.waitForDone();
+    foreach (const QList<KBlockdOperation*> &operations, m_operations) {
+        qDeleteAll(operations);
+    }
 }
 
 QList<KDiskInfo> KBlockdInterfaceAdaptor::disks() const {
+    KDiskMetricTimer timer(s_diskscalls);
     return KDiskManager::disks();
 }
 
+QList<KDiskInfoV2> KBlockdInterfaceAdaptor::disksV2() const {
+    KDiskMetricTimer timer(s_disksv2calls);
+    QList<KDiskInfoV2> result;
+    foreach (const KDiskInfo &disk, KDiskManager::disks()) {
+        result.append(KDiskInfoV2(disk));
+    }
+    return result;
+}
+
 QStringList KBlockdInterfaceAdaptor::supported() const {
+    KDiskMetricTimer timer(s_supportedcalls);
     return KDiskManager::supported();
 }
 
-bool KBlockdInterfaceAdaptor::rescan() const {
-    return KDiskManager::rescan();
+bool KBlockdInterfaceAdaptor::rescan() {
+    KDiskMetricTimer timer(s_rescancalls);
+    // the job does not block, the reply is sent once it finishes
+    context()->setDelayedReply(true);
+    KDiskJob *job = KDiskManager::rescanJob();
+    m_rescans.insert(job, context()->message());
+    connect(job, SIGNAL(finished(bool)), this, SLOT(rescanFinished(bool)));
+    return false;
 }
 
 KDiskInfo KBlockdInterfaceAdaptor::info(const QString &disk) const {
+    KDiskMetricTimer timer(s_infocalls);
     return KDiskManager::info(disk);
 }
 
-bool KBlockdInterfaceAdaptor::mount(const QString &disk) const {
+KDiskInfoV2 KBlockdInterfaceAdaptor::infoV2(const QString &disk) const {
+    KDiskMetricTimer timer(s_infov2calls);
+    return KDiskInfoV2(KDiskManager::info(disk));
+}
+
+bool KBlockdInterfaceAdaptor::mount(const QString &disk) {
+    KDiskMetricTimer timer(s_mountcalls);
+    // udev is not thread-safe, the disk is looked up before the operation is queued
     const KDiskInfo info = KDiskManager::info(disk);
-    return KDiskManager::mount(info);
+    return enqueue(new KBlockdOperation(KBlockdOperation::Mount, disk, info, QStringList()));
 }
 
-bool KBlockdInterfaceAdaptor::unmount(const QString &disk) const {
+bool KBlockdInterfaceAdaptor::mountWithOptions(const QString &disk, const QString &options) {
+    KDiskMetricTimer timer(s_mountwithoptionscalls);
     const KDiskInfo info = KDiskManager::info(disk);
-    return KDiskManager::unmount(info);
+    return enqueue(new KBlockdOperation(KBlockdOperation::Mount, disk, info, QStringList() << options));
 }
 
+bool KBlockdInterfaceAdaptor::unmount(const QString &disk) {
+    KDiskMetricTimer timer(s_unmountcalls);
+    const KDiskInfo info = KDiskManager::info(disk);
+    return enqueue(new KBlockdOperation(KBlockdOperation::Unmount, disk, info, QStringList()));
+}
+
+bool KBlockdInterfaceAdaptor::trim(const QString &disk) {
+    KDiskMetricTimer timer(s_trimcalls);
+    const KDiskInfo info = KDiskManager::info(disk);
+    return enqueue(new KBlockdOperation(KBlockdOperation::Trim, disk, info, QStringList()));
+}
+
+QString KBlockdInterfaceAdaptor::mountImage(const QString &path, const QString &options) {
+    KDiskMetricTimer timer(s_mountimagecalls);
+    // operations on the same image file are serialized, the loop device is not known yet
+    enqueue(new KBlockdOperation(KBlockdOperation::MountImage, path, KDiskInfo(),
+        QStringList() << path << options));
+    return QString();
+}
+
+QVariantMap KBlockdInterfaceAdaptor::capabilities() const {
+    KDiskMetricTimer timer(s_capabilitiescalls);
+    QVariantMap result;
+    const QMap<QString, int> capabilities = KDiskManager::capabilities();
+    foreach (const QString &fstype, capabilities.keys()) {
+        result.insert(fstype, capabilities.value(fstype));
+    }
+    return result;
+}
+
+QList<KDiskInfo> KBlockdInterfaceAdaptor::infoMany(const QStringList &disks) const {
+    KDiskMetricTimer timer(s_infomanycalls);
+    return KDiskManager::infoAll(disks);
+}
+
+QVariantMap KBlockdInterfaceAdaptor::mountMany(const QStringList &disks) {
+    KDiskMetricTimer timer(s_mountmanycalls);
+    return enqueueMany(KBlockdOperation::Mount, disks);
+}
+
+QVariantMap KBlockdInterfaceAdaptor::unmountMany(const QStringList &disks) {
+    KDiskMetricTimer timer(s_unmountmanycalls);
+    return enqueueMany(KBlockdOperation::Unmount, disks);
+}
+
+QDBusObjectPath KBlockdInterfaceAdaptor::rescanJob() {
+    KDiskMetricTimer timer(s_rescanjobcalls);
+    return exportJob(KDiskManager::rescanJob());
+}
+
+QDBusObjectPath KBlockdInterfaceAdaptor::fsckJob(const QString &disk) {
+    KDiskMetricTimer timer(s_fsckjobcalls);
+    const KDiskInfo info = KDiskManager::info(disk);
+    return exportJob(KDiskManager::fsckJob(info));
+}
+
+QDBusObjectPath KBlockdInterfaceAdaptor::mkfsJob(const QString &disk, const QString &fstype) {
+    KDiskMetricTimer timer(s_mkfsjobcalls);
+    const KDiskInfo info = KDiskManager::info(disk);
+    return exportJob(KDiskManager::mkfsJob(info, fstype));
+}
+
+uint KBlockdInterfaceAdaptor::changes(uint since, const QString &epoch, QList<KDiskInfo> &changed, QStringList &removed, QString &current) const {
+    KDiskMetricTimer timer(s_changescalls);
+    current = m_epoch;
+    foreach (const KBlockdChange &change, changesSince(since, epoch)) {
+        if (change.removed) {
+            removed.append(change.disk.name);
+        } else {
+            changed.append(change.disk);
+        }
+    }
+    return m_generation;
+}
+
+uint KBlockdInterfaceAdaptor::changesV2(uint since, const QString &epoch, QList<KDiskInfoV2> &changed, QStringList &parents, QStringList &removed, QString &current) const {
+    KDiskMetricTimer timer(s_changesv2calls);
+    current = m_epoch;
+    // the parents are in the same order as the changed disks, empty for whole disks
+    foreach (const KBlockdChange &change, changesSince(since, epoch)) {
+        if (change.removed) {
+            removed.append(change.disk.name);
+        } else {
+            changed.append(KDiskInfoV2(change.disk));
+            parents.append(change.parent);
+        }
+    }
+    return m_generation;
+}
+
+QList<KBlockdInterfaceAdaptor::KBlockdChange> KBlockdInterfaceAdaptor::changesSince(uint since, const QString &epoch) const {
+    // generation of another instance, everything is new to the client
+    if (epoch != m_epoch || since > m_generation) {
+        since = 0;
+    }
+
+    QList<KBlockdChange> result;
+    foreach (const KBlockdChange &change, m_changes) {
+        if (change.generation > since) {
+            result.append(change);
+        }
+    }
+    return result;
+}
+
+QList<KDiskStats> KBlockdInterfaceAdaptor::stats() const {
+    KDiskMetricTimer timer(s_statscalls);
+    // the first call starts sampling, the rates are known from the second sample on
+    if (s_statsinterval > 0) {
+        if (KDiskManager::statsInterval() == 0) {
+            KDiskManager::setStatsInterval(s_statsinterval);
+        }
+        m_statsidle->start();
+    }
+    return KDiskManager::stats();
+}
+
+QList<KDiskUsage> KBlockdInterfaceAdaptor::usage() const {
+    KDiskMetricTimer timer(s_usagecalls);
+    return KDiskManager::usage();
+}
+
+QString KBlockdInterfaceAdaptor::queueParameter(const QString &disk, const QString &parameter) const {
+    KDiskMetricTimer timer(s_queueparametercalls);
+    return KDiskManager::queueParameter(disk, parameter);
+}
+
+bool KBlockdInterfaceAdaptor::setQueueParameter(const QString &disk, const QString &parameter, const QString &value) {
+    KDiskMetricTimer timer(s_setqueueparametercalls);
+    return enqueue(new KBlockdOperation(KBlockdOperation::SetQueueParameter, disk, KDiskInfo(),
+        QStringList() << disk << parameter << value));
+}
+
+QString KBlockdInterfaceAdaptor::metrics() const {
+    KDiskMetricTimer timer(s_metricscalls);
+    return QString::fromUtf8(KDiskManager::metrics());
+}
+
+void KBlockdInterfaceAdaptor::trackAdded(const KDiskInfo &disk) {
+    m_generation++;
+    track(disk, false);
+    emit diskAdded(disk, m_generation, m_epoch);
+    emit diskAddedV2(KDiskInfoV2(disk), KDiskManager::parent(disk.name), m_generation, m_epoch);
+}
+
+void KBlockdInterfaceAdaptor::trackChanged(const KDiskInfo &disk) {
+    m_generation++;
+    track(disk, false);
+    emit diskChanged(disk, m_generation, m_epoch);
+    emit diskChangedV2(KDiskInfoV2(disk), KDiskManager::parent(disk.name), m_generation, m_epoch);
+}
+
+void KBlockdInterfaceAdaptor::trackRemoved(const KDiskInfo &disk) {
+    m_generation++;
+    track(disk, true);
+    emit diskRemoved(disk, m_generation, m_epoch);
+}
+
+void KBlockdInterfaceAdaptor::statsIdle() {
+    qDebug() << "no I/O statistics consumers, sampling stopped";
+    KDiskManager::setStatsInterval(0);
+}
+
+void KBlockdInterfaceAdaptor::track(const KDiskInfo &disk, const bool removed) {
+    KBlockdChange change;
+    change.generation = m_generation;
+    change.disk = disk;
+    // removed disks are no longer in the registry, they do not need it anyway
+    if (!removed) {
+        change.parent = KDiskManager::parent(disk.name);
+    }
+    change.removed = removed;
+    m_changes.insert(disk.name, change);
+}
+
+void KBlockdInterfaceAdaptor::jobFinished() {
+    // finished jobs linger for a while so that clients can still query the result
+    QTimer::singleShot(60000, sender(), SLOT(deleteLater()));
+}
+
+void KBlockdInterfaceAdaptor::rescanFinished(bool result) {
+    const QDBusMessage message = m_rescans.take(sender());
+    QDBusConnection::systemBus().send(message.createReply(QVariant(result)));
+}
+
+void KBlockdInterfaceAdaptor::operationFinished() {
+    KBlockdOperation *operation = qobject_cast<KBlockdOperation*>(sender());
+    Q_ASSERT(operation);
+    KBlockdBatch *batch = operation->m_batch;
+    if (batch) {
+        batch->results.insert(operation->m_name, operation->m_result);
+        batch->pending--;
+        if (batch->pending == 0) {
+            QDBusConnection::systemBus().send(batch->message.createReply(QVariant(batch->results)));
+            delete batch;
+        }
+    } else {
+        QDBusConnection::systemBus().send(operation->m_message.createReply(operation->m_result));
+    }
+
+    QList<KBlockdOperation*> &operations = m_operations[operation->m_device];
+    operations.removeOne(operation);
+    if (operations.isEmpty()) {
+        m_operations.remove(operation->m_device);
+    } else {
+        m_pool.start(operations.first());
+    }
+    operation->deleteLater();
+}
+
+QDBusContext* KBlockdInterfaceAdaptor::context() const {
+    return static_cast<KBlockdObject*>(parent());
+}
+
+QDBusObjectPath KBlockdInterfaceAdaptor::exportJob(KDiskJob *job) {
+    m_jobid++;
+    const QString path = QString("/com/kblockd/Block/jobs/%1").arg(m_jobid);
+
+    job->setAutoDelete(false);
+    new KBlockdJobAdaptor(job);
+    connect(job, SIGNAL(finished(bool)), this, SLOT(jobFinished()));
+    // the job starts once the reply has been queued, objects are unregistered on destruction
+    if (!QDBusConnection::systemBus().registerObject(path, job)) {
+        qWarning() << "could not register job" << QDBusConnection::systemBus().lastError().message();
+    }
+
+    return QDBusObjectPath(path);
+}
+
+bool KBlockdInterfaceAdaptor::enqueue(KBlockdOperation *operation) {
+    // the reply is sent once the operation is done, the return value is not used
+    context()->setDelayedReply(true);
+    operation->m_message = context()->message();
+    schedule(operation);
+    return false;
+}
+
+QVariantMap KBlockdInterfaceAdaptor::enqueueMany(const KBlockdOperation::KOperationType type, const QStringList &disks) {
+    if (disks.isEmpty()) {
+        return QVariantMap();
+    }
+
+    // the operations of the devices run in parallel, same as separate calls would
+    context()->setDelayedReply(true);
+    KBlockdBatch *batch = new KBlockdBatch();
+    batch->message = context()->message();
+    batch->pending = disks.size();
+    const QList<KDiskInfo> infos = KDiskManager::infoAll(disks);
+    for (int i = 0; i < disks.size(); i++) {
+        KBlockdOperation *operation = new KBlockdOperation(type, disks.at(i), infos.at(i), QStringList());
+        operation->m_batch = batch;
+        schedule(operation);
+    }
+    return QVariantMap();
+}
+
+void KBlockdInterfaceAdaptor::schedule(KBlockdOperation *operation) {
+    connect(operation, SIGNAL(finished()), this, SLOT(operationFinished()), Qt::QueuedConnection);
+
+    QList<KBlockdOperation*> &operations = m_operations[operation->m_device];
+    operations.append(operation);
+    if (operations.size() == 1) {
+        m_pool.start(operation);
+    }
+}
+
+KBlockdJobAdaptor::KBlockdJobAdaptor(KDiskJob *parent)
+    : QDBusAbstractAdaptor(parent),
+    m_job(parent) {
+    setAutoRelaySignals(true);
+}
+
+KBlockdJobAdaptor::~KBlockdJobAdaptor() {
+}
+
+bool KBlockdJobAdaptor::completed() const {
+    return m_job->isFinished();
+}
+
+bool KBlockdJobAdaptor::result() const {
+    return m_job->result();
+}
+
+QString KBlockdJobAdaptor::errorString() const {
+    return m_job->errorString();
+}
+
+int KBlockdJobAdaptor::percent() const {
+    return m_job->percent();
+}
+
+int KBlockdJobAdaptor::eta() const {
+    return m_job->eta();
+}
+
+QString KBlockdJobAdaptor::output() const {
+    return QString::fromLocal8Bit(m_job->output());
+}
 
 int main(int argc, char* argv[]) {
     QCoreApplication app(argc, argv);
 
     app.setApplicationName("kblockd");
 
+    KDiskManager::setSnapshot(KBLOCKD_SNAPSHOT);
+    KDiskManager::setReceiveBuffer(16 * 1024 * 1024);
+    // sampling starts with the first stats() call, the interval is in milliseconds
+    const QByteArray statsinterval = qgetenv("KBLOCKD_STATS_INTERVAL");
+    if (!statsinterval.isEmpty()) {
+        s_statsinterval = qMax(statsinterval.toInt(), 0);
+    }
+    // every minute, agents subscribe to usageThreshold instead of polling df
+    KDiskManager::setUsageThresholds(QList<int>() << 80 << 90 << 95);
+    KDiskManager::setUsageInterval(60000);
+    // freshly formatted disks are mountable before udevd gets to probe them
+    KDiskManager::setProbing(true);
+    // weekly, 1 GiB at a time every 100 milliseconds
+    KDiskManager::setTrimSchedule(7 * 24 * 60 * 60 * 1000, Q_INT64_C(1073741824), 100);
+
+    // e.g. for the textfile collector of the Prometheus node exporter
+    const QString metricsfile = QFile::decodeName(qgetenv("KBLOCKD_METRICS_FILE"));
+    if (!metricsfile.isEmpty()) {
+        KDiskManager::setMetricsFile(metricsfile, 15000);
+    }
+
+    QFile queuerules(KBLOCKD_QUEUE_RULES);
+    if (queuerules.open(QFile::ReadOnly)) {
+        const QString rules = QString::fromUtf8(queuerules.readAll());
+        KDiskManager::setQueueProfiles(rules.split('\n'));
+    }
+
     qRegisterMetaType<KDiskInfo>();
     qRegisterMetaType<QList<KDiskInfo> >();
     qDBusRegisterMetaType<KDiskInfo>();
     qDBusRegisterMetaType<QList<KDiskInfo> >();
+    qRegisterMetaType<KDiskInfoV2>();
+    qRegisterMetaType<QList<KDiskInfoV2> >();
+    qDBusRegisterMetaType<KDiskInfoV2>();
+    qDBusRegisterMetaType<QList<KDiskInfoV2> >();
+    qRegisterMetaType<KDiskStats>();
+    qRegisterMetaType<QList<KDiskStats> >();
+    qDBusRegisterMetaType<KDiskStats>();
+    qDBusRegisterMetaType<QList<KDiskStats> >();
+    qRegisterMetaType<KDiskUsage>();
+    qRegisterMetaType<QList<KDiskUsage> >();
+    qDBusRegisterMetaType<KDiskUsage>();
+    qDBusRegisterMetaType<QList<KDiskUsage> >();
 
-    new KBlockdInterfaceAdaptor(&app);
+    KBlockdObject *block = new KBlockdObject(&app);
+    new KBlockdInterfaceAdaptor(block);
     QDBusConnection connection = QDBusConnection::systemBus();
-    const bool object = connection.registerObject("/com/kblockd/Block", &app);
+    const bool object = connection.registerObject("/com/kblockd/Block", block);
     if (object) {
         const bool service = connection.registerService("com.kblockd.Block");
         if (service) {
@@ -0,0 +1,377 @@
+#include <QCoreApplication>
+#include <QDBusArgument>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QProcess>
+#include <QStringList>
+#include <QTimer>
+
+#include "kdiskmanager.hpp"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+    benchmarks the disk manager on synthetic sysfs/procfs trees fed through a pipe, no root
+    privileges nor udev are required. Every tree size runs in its own process because the
+    manager state is global
+*/
+
+static const int s_iterations = 10000;
+static const int s_latencyiterations = 100;
+
+class KBlockdBenchReceiver : public QObject {
+    Q_OBJECT
+
+    public:
+        KBlockdBenchReceiver(QObject *parent = Q_NULLPTR);
+
+        int m_count;
+
+    public Q_SLOTS:
+        void diskChanged(const KDiskInfo &disk);
+
+    Q_SIGNALS:
+        void received();
+};
+
+KBlockdBenchReceiver::KBlockdBenchReceiver(QObject *parent)
+    : QObject(parent),
+    m_count(0) {
+}
+
+void KBlockdBenchReceiver::diskChanged(const KDiskInfo &disk) {
+    Q_UNUSED(disk);
+    m_count++;
+    emit received();
+}
+
+static void messageHandler(QtMsgType type, const char *message) {
+    // the manager logs every event, that would dominate the measurements
+    if (type != QtDebugMsg) {
+        fprintf(stderr, "%s\n", message);
+    }
+}
+
+static bool writeFile(const QString &path, const QByteArray &data) {
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qWarning() << "could not create" << path;
+        return false;
+    }
+    return (file.write(data) == data.size());
+}
+
+static QString deviceName(const int index) {
+    // every other device is a partition of the disk before it
+    if (index % 2 == 0) {
+        return QString("bd%1").arg(index / 2);
+    }
+    return QString("bd%1p1").arg(index / 2);
+}
+
+static QByteArray deviceEvent(const int index, const char *action) {
+    const QString name = deviceName(index);
+    QByteArray result;
+    result += "ACTION=" + QByteArray(action) + "\n";
+    result += "SUBSYSTEM=block\n";
+    result += "DEVNAME=/dev/" + name.toLatin1() + "\n";
+    result += (index % 2 == 0) ? "DEVTYPE=disk\n" : "DEVTYPE=partition\n";
+    result += "ID_FS_TYPE=ext4\n";
+    result += "ID_FS_LABEL=bench" + QByteArray::number(index) + "\n";
+    result += "ID_FS_UUID=" + QByteArray::number(0x10000000 + index, 16) + "-bench\n";
+    result += "\n";
+    return result;
+}
+
+static bool createTree(const QString &root, const int devices) {
+    const QString blockdirectory = root + "/sys/class/block";
+    QDir rootdir;
+    if (!rootdir.mkpath(blockdirectory) || !rootdir.mkpath(root + "/proc/self")) {
+        qWarning() << "could not create" << root;
+        return false;
+    }
+
+    QByteArray mountinfo;
+    for (int i = 0; i < devices; i++) {
+        const QString name = deviceName(i);
+        QString directory;
+        if (i % 2 == 0) {
+            directory = blockdirectory + "/" + name;
+            const QString queuedirectory = directory + "/queue";
+            if (!rootdir.mkpath(queuedirectory)) {
+                qWarning() << "could not create" << queuedirectory;
+                return false;
+            }
+            writeFile(queuedirectory + "/logical_block_size", "512\n");
+            writeFile(queuedirectory + "/physical_block_size", "4096\n");
+            writeFile(queuedirectory + "/minimum_io_size", "4096\n");
+            writeFile(queuedirectory + "/optimal_io_size", "0\n");
+            writeFile(queuedirectory + "/rotational", "0\n");
+            writeFile(queuedirectory + "/discard_max_bytes", "2147450880\n");
+        } else {
+            // the sysfs entry of partition is a directory in the sysfs entry of the disk
+            const QString parent = deviceName(i - 1);
+            directory = blockdirectory + "/" + parent + "/" + name;
+            if (!rootdir.mkpath(directory)
+                || ::symlink(QFile::encodeName(parent + "/" + name).constData(),
+                    QFile::encodeName(blockdirectory + "/" + name).constData()) != 0) {
+                qWarning() << "could not create" << directory;
+                return false;
+            }
+            writeFile(directory + "/partition", "1\n");
+            if (i % 4 == 1) {
+                mountinfo += QByteArray::number(100 + i) + " 1 8:" + QByteArray::number(i)
+                    + " / /mnt/" + name.toLatin1() + " rw,noatime shared:1 - ext4 /dev/"
+                    + name.toLatin1() + " rw\n";
+            }
+        }
+        writeFile(directory + "/size", "8388608\n");
+        writeFile(directory + "/alignment_offset", "0\n");
+        writeFile(directory + "/stat", "0 0 0 0 0 0 0 0 0 0 0\n");
+    }
+
+    return writeFile(root + "/proc/self/mountinfo", mountinfo);
+}
+
+// writes to the non-blocking pipe, letting the manager drain it whenever it is full
+static bool feed(const int fd, const QByteArray &data) {
+    int offset = 0;
+    while (offset < data.size()) {
+        const ssize_t count = ::write(fd, data.constData() + offset, data.size() - offset);
+        if (count > 0) {
+            offset += count;
+        } else if (count == -1 && errno != EAGAIN && errno != EINTR) {
+            qWarning() << "could not write events" << qt_error_string(errno);
+            return false;
+        }
+        QCoreApplication::processEvents();
+    }
+    return true;
+}
+
+static void report(const int devices, const char *name, const qint64 nsecs, const int count) {
+    printf("%-8d %-24s %12.3f us\n", devices, name, double(nsecs) / count / 1000.0);
+}
+
+static void reportMemory(const int devices, const char *name, const qint64 kbytes) {
+    printf("%-8d %-24s %12lld kB\n", devices, name, kbytes);
+}
+
+// resident set size of the process in kilobytes, -1 if unknown
+static qint64 residentMemory() {
+    QFile file("/proc/self/status");
+    if (!file.open(QFile::ReadOnly)) {
+        return -1;
+    }
+    foreach (const QByteArray &line, file.readAll().split('\n')) {
+        if (line.startsWith("VmRSS:")) {
+            return line.mid(6).trimmed().split(' ').first().toLongLong();
+        }
+    }
+    return -1;
+}
+
+static int runBenchmark(const QString &root, const int devices) {
+    if (!createTree(root, devices)) {
+        return 1;
+    }
+    const QString eventsource = root + "/events";
+    if (::mkfifo(QFile::encodeName(eventsource).constData(), 0600) != 0) {
+        qWarning() << "could not create" << eventsource << qt_error_string(errno);
+        return 1;
+    }
+
+    KDiskManager::setSystemRoot(root);
+    KDiskManager::setEventSource(eventsource);
+    KDiskManager::setSnapshot(QString());
+    KDiskManager::setQuietWindow(0);
+    const qint64 baseline = residentMemory();
+    KDiskManager manager;
+    KBlockdBenchReceiver receiver;
+    QObject::connect(&manager, SIGNAL(changed(KDiskInfo)), &receiver, SLOT(diskChanged(KDiskInfo)));
+
+    const int fd = ::open(QFile::encodeName(eventsource).constData(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        qWarning() << "could not open" << eventsource << qt_error_string(errno);
+        return 1;
+    }
+
+    QByteArray events;
+    for (int i = 0; i < devices; i++) {
+        events += deviceEvent(i, "add");
+    }
+    QElapsedTimer timer;
+    timer.start();
+    if (!feed(fd, events)) {
+        ::close(fd);
+        return 1;
+    }
+    while (KDiskManager::disks().size() < devices && timer.elapsed() < 60000) {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents);
+    }
+    if (KDiskManager::disks().size() != devices) {
+        qWarning() << "expected" << devices << "disks, got" << KDiskManager::disks().size();
+        ::close(fd);
+        return 1;
+    }
+    report(devices, "add (per device)", timer.nsecsElapsed(), devices);
+    // the registry and its indexes, the pipe buffer of the manager is included too
+    const qint64 resident = residentMemory();
+    if (baseline >= 0 && resident >= 0) {
+        reportMemory(devices, "registry resident", resident - baseline);
+    }
+
+    timer.restart();
+    for (int i = 0; i < s_iterations; i++) {
+        KDiskManager::info("/dev/" + deviceName(i % devices));
+    }
+    report(devices, "info()", timer.nsecsElapsed(), s_iterations);
+
+    timer.restart();
+    int total = 0;
+    for (int i = 0; i < s_iterations; i++) {
+        total += KDiskManager::disks().size();
+    }
+    Q_UNUSED(total);
+    report(devices, "disks()", timer.nsecsElapsed(), s_iterations);
+
+    timer.restart();
+    for (int i = 0; i < s_iterations; i++) {
+        KDiskManager::mountpoint("/dev/" + deviceName(i % devices));
+    }
+    report(devices, "mountpoint()", timer.nsecsElapsed(), s_iterations);
+
+    const int marshallings = qMax(10, s_iterations / devices);
+    const QList<KDiskInfo> disks = KDiskManager::disks();
+    timer.restart();
+    for (int i = 0; i < marshallings; i++) {
+        QDBusArgument argument;
+        argument << disks;
+    }
+    report(devices, "disks marshalling", timer.nsecsElapsed(), marshallings);
+
+    // latency from writing the event to the signal, includes the notifier wake-up
+    QEventLoop loop;
+    QObject::connect(&receiver, SIGNAL(received()), &loop, SLOT(quit()));
+    qint64 latency = 0;
+    for (int i = 0; i < s_latencyiterations; i++) {
+        const int count = receiver.m_count;
+        timer.restart();
+        if (!feed(fd, deviceEvent(i % devices, "change"))) {
+            ::close(fd);
+            return 1;
+        }
+        if (receiver.m_count == count) {
+            QTimer::singleShot(1000, &loop, SLOT(quit()));
+            loop.exec();
+        }
+        latency += timer.nsecsElapsed();
+        if (receiver.m_count == count) {
+            qWarning() << "change event was not signaled";
+            ::close(fd);
+            return 1;
+        }
+    }
+    report(devices, "event to signal", latency, s_latencyiterations);
+
+    ::close(fd);
+    return 0;
+}
+
+/*
+    udev cannot be pointed at the synthetic tree, startup is measured with the disks of the host.
+    The time is until the registry is usable, the verification of the snapshot runs afterwards
+*/
+static int runStartup(const QString &mode, const QString &snapshot) {
+    if (mode == "snapshot" && !QFile::exists(snapshot)) {
+        // nothing was enumerated, there is no snapshot to compare with
+        return 0;
+    }
+
+    KDiskManager::setSnapshot(snapshot);
+    QElapsedTimer timer;
+    timer.start();
+    const int devices = KDiskManager::disks().size();
+    report(devices, (mode == "cold") ? "startup (cold)" : "startup (snapshot)",
+        timer.nsecsElapsed(), 1);
+    // the cold start writes the snapshot once the manager is destroyed
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    qInstallMsgHandler(messageHandler);
+
+    QStringList arguments = app.arguments();
+    arguments.removeFirst();
+
+    // single tree size in this process
+    if (arguments.size() == 2 && arguments.at(0).startsWith("--devices=")) {
+        const int devices = arguments.at(0).mid(10).toInt();
+        if (devices < 1) {
+            qWarning() << "invalid number of devices" << arguments.at(0);
+            return 1;
+        }
+        return runBenchmark(arguments.at(1), devices);
+    }
+    // single startup in this process
+    if (arguments.size() == 2 && arguments.at(0).startsWith("--startup=")) {
+        return runStartup(arguments.at(0).mid(10), arguments.at(1));
+    }
+
+    QList<int> sizes;
+    foreach (const QString &argument, arguments) {
+        const int devices = argument.toInt();
+        if (devices < 1) {
+            qWarning() << "usage: kblockd_bench [devices...]";
+            return 1;
+        }
+        sizes.append(devices);
+    }
+    if (sizes.isEmpty()) {
+        sizes << 10 << 100 << 1000 << 10000;
+    }
+
+    printf("%-8s %-24s %15s\n", "devices", "benchmark", "per call / size");
+    fflush(stdout);
+    int result = 0;
+    foreach (const int devices, sizes) {
+        const QString root = QDir::tempPath() + QString("/kblockd_bench.%1.%2")
+            .arg(QCoreApplication::applicationPid()).arg(devices);
+        QProcess process;
+        process.setProcessChannelMode(QProcess::ForwardedChannels);
+        process.start(QCoreApplication::applicationFilePath(),
+            QStringList() << QString("--devices=%1").arg(devices) << root);
+        if (!process.waitForFinished(-1) || process.exitCode() != 0) {
+            qWarning() << "benchmark with" << devices << "devices failed";
+            result = 1;
+        }
+        QProcess::execute("rm", QStringList() << "-rf" << root);
+    }
+
+    // enumeration with udev versus loading the snapshot written by it
+    const QString snapshot = QDir::tempPath() + QString("/kblockd_bench.%1.snapshot")
+        .arg(QCoreApplication::applicationPid());
+    foreach (const QString &mode, QStringList() << "cold" << "snapshot") {
+        QProcess process;
+        process.setProcessChannelMode(QProcess::ForwardedChannels);
+        process.start(QCoreApplication::applicationFilePath(),
+            QStringList() << QString("--startup=%1").arg(mode) << snapshot);
+        if (!process.waitForFinished(-1) || process.exitCode() != 0) {
+            qWarning() << mode << "startup benchmark failed";
+            result = 1;
+        }
+    }
+    QFile::remove(snapshot);
+    return result;
+}
+
+#include "kblockd_bench.moc"
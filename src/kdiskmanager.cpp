@@ -1,20 +1,107 @@
 #include <QDebug>
 #include <QFile>
 #include <QDir>
-#include <QTimerEvent>
+#include <QSocketNotifier>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QSet>
+#include <QPair>
+#include <QThread>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QDataStream>
+#include <QDateTime>
+#include <QRegExp>
+#include <QVector>
 #include <QStandardPaths>
 #include <QProcess>
-#include <QCoreApplication>
+#include <QEventLoop>
+#include <QTimer>
 #include <QDBusConnection>
-#include <QDBusInterface>
+#include <QDBusMessage>
 #include <QDBusReply>
 #include <QDBusMetaType>
+#include <QVariant>
 
 #include "kdiskmanager.hpp"
 
 #include <libudev.h>
 #include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <limits.h>
+
+// linux/fs.h conflicts with sys/mount.h on some systems
+struct KTrimRange {
+    quint64 start;
+    quint64 len;
+    quint64 minlen;
+};
+#ifndef FITRIM
+#  define FITRIM _IOWR('X', 121, KTrimRange)
+#endif
+#ifndef BLKDISCARD
+#  define BLKDISCARD _IO(0x12, 119)
+#endif
+#ifndef BLKGETSIZE64
+#  define BLKGETSIZE64 _IOR(0x12, 114, size_t)
+#endif
+
+// struct loop_config of linux/loop.h, the headers before Linux 5.8 do not have it
+struct KLoopInfo {
+    quint64 device;
+    quint64 inode;
+    quint64 rdevice;
+    quint64 offset;
+    quint64 sizelimit;
+    quint32 number;
+    quint32 encrypttype;
+    quint32 encryptkeysize;
+    quint32 flags;
+    quint8 filename[64];
+    quint8 cryptname[64];
+    quint8 encryptkey[32];
+    quint64 init[2];
+};
+struct KLoopConfig {
+    quint32 fd;
+    quint32 blocksize;
+    KLoopInfo info;
+    quint64 reserved[8];
+};
+#ifndef LOOP_CTL_GET_FREE
+#  define LOOP_CTL_GET_FREE 0x4C82
+#endif
+#ifndef LOOP_CONFIGURE
+#  define LOOP_CONFIGURE 0x4C0A
+#endif
+#ifndef LOOP_CLR_FD
+#  define LOOP_CLR_FD 0x4C01
+#endif
+#ifndef LO_FLAGS_READ_ONLY
+#  define LO_FLAGS_READ_ONLY 1
+#endif
+#ifndef LO_FLAGS_AUTOCLEAR
+#  define LO_FLAGS_AUTOCLEAR 4
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#  define LO_FLAGS_DIRECT_IO 16
+#endif
+
+// prefix of the sysfs and procfs paths, empty for the live system
+static QString s_systemroot;
 
 static const QStringList s_knownfstypes = QStringList()
         << "ext2"
@@ -28,9 +115,131 @@ static const QStringList s_knownfstypes = QStringList()
         << "minix"
         << "reiserfs";
 
+// tools to grow the filesystem and if it can discard unused blocks (FITRIM, swap discard)
+struct KFilesystemTools {
+    const char* fstype;
+    const char* grow;
+    bool discard;
+};
+static const KFilesystemTools s_filesystemtools[] = {
+    { "ext2", "resize2fs", true },
+    { "ext3", "resize2fs", true },
+    { "ext4", "resize2fs", true },
+    { "jfs", Q_NULLPTR, true },
+    { "xfs", "xfs_growfs", true },
+    { "btrfs", "btrfs", true },
+    { "ntfs", "ntfsresize", true },
+    { "vfat", "fatresize", true },
+    { "minix", Q_NULLPTR, false },
+    { "reiserfs", "resize_reiserfs", false },
+    { "swap", Q_NULLPTR, true },
+};
+static const int s_filesystemtoolssize = sizeof(s_filesystemtools) / sizeof(KFilesystemTools);
+
+static bool hasExecutable(const QString &name) {
+    return !QStandardPaths::findExecutable(name).isEmpty();
+}
+
+// walks the PATH for every tool, the result is cached by KDiskManagerPrivate
+static QMap<QString, int> filesystemCapabilities() {
+    QMap<QString, int> result;
+    for (int i = 0; i < s_filesystemtoolssize; i++) {
+        const KFilesystemTools &tools = s_filesystemtools[i];
+        const QString fstype = QString::fromLatin1(tools.fstype);
+        int capabilities = KDiskManager::NoCapability;
+        if (fstype == "swap") {
+            if (hasExecutable("mkswap")) {
+                capabilities |= KDiskManager::CanMkfs;
+            }
+        } else {
+            if (hasExecutable("mkfs." + fstype)) {
+                capabilities |= KDiskManager::CanMkfs;
+            }
+            if (hasExecutable("fsck." + fstype)) {
+                capabilities |= KDiskManager::CanFsck;
+            }
+        }
+        if (tools.grow && hasExecutable(QString::fromLatin1(tools.grow))) {
+            capabilities |= KDiskManager::CanGrow;
+        }
+        if (tools.discard) {
+            capabilities |= KDiskManager::CanDiscard;
+        }
+        result.insert(fstype, capabilities);
+    }
+    return result;
+}
+
+// filesystem types are few, the disks share them instead of allocating their own copy and
+// marshalling them over D-Bus does not convert them to string every time
+struct KFilesystemAtom {
+    QByteArray fstype;
+    QString string;
+};
+
+static QList<KFilesystemAtom> filesystemAtoms() {
+    QStringList fstypes = s_knownfstypes;
+    fstypes << "swap" << "exfat" << "f2fs" << "iso9660" << "udf" << "squashfs"
+        << "crypto_LUKS" << "LVM2_member" << "linux_raid_member";
+    QList<KFilesystemAtom> result;
+    foreach (const QString &fstype, fstypes) {
+        KFilesystemAtom atom;
+        atom.fstype = fstype.toLatin1();
+        atom.string = fstype;
+        result.append(atom);
+    }
+    return result;
+}
+static const QList<KFilesystemAtom> s_filesystematoms = filesystemAtoms();
+
+static QByteArray internFilesystem(const QByteArray &fstype) {
+    foreach (const KFilesystemAtom &atom, s_filesystematoms) {
+        if (atom.fstype == fstype) {
+            return atom.fstype;
+        }
+    }
+    return fstype;
+}
+
+// the overloads match the atoms before converting, known types never allocate a temporary
+static QByteArray internFilesystem(const char *fstype) {
+    foreach (const KFilesystemAtom &atom, s_filesystematoms) {
+        if (qstrcmp(atom.fstype.constData(), fstype) == 0) {
+            return atom.fstype;
+        }
+    }
+    return QByteArray(fstype);
+}
+
+static QByteArray internFilesystem(const QString &fstype) {
+    foreach (const KFilesystemAtom &atom, s_filesystematoms) {
+        if (atom.string == fstype) {
+            return atom.fstype;
+        }
+    }
+    return fstype.toUtf8();
+}
+
+static QString filesystemString(const QByteArray &fstype) {
+    foreach (const KFilesystemAtom &atom, s_filesystematoms) {
+        // interned types share the data, comparing the pointers is enough for them
+        if (atom.fstype.constData() == fstype.constData() || atom.fstype == fstype) {
+            return atom.string;
+        }
+    }
+    return QString::fromUtf8(fstype.constData(), fstype.size());
+}
+
 KDiskInfo::KDiskInfo()
     : size(0),
-    type(KDiskType::None) {
+    type(KDiskType::None),
+    bytes(0),
+    logicalblocksize(0),
+    physicalblocksize(0),
+    minimumio(0),
+    optimalio(0),
+    alignmentoffset(0),
+    rotational(false) {
 }
 
 KDiskInfo::KDiskInfo(const KDiskInfo &info)
@@ -39,7 +248,30 @@ KDiskInfo::KDiskInfo(const KDiskInfo &info)
     fstype(info.fstype),
     fsuuid(info.fsuuid),
     size(info.size),
-    type(info.type) {
+    type(info.type),
+    bytes(info.bytes),
+    logicalblocksize(info.logicalblocksize),
+    physicalblocksize(info.physicalblocksize),
+    minimumio(info.minimumio),
+    optimalio(info.optimalio),
+    alignmentoffset(info.alignmentoffset),
+    rotational(info.rotational) {
+}
+
+KDiskInfo::KDiskInfo(KDiskInfo &&info)
+    : size(info.size),
+    type(info.type),
+    bytes(info.bytes),
+    logicalblocksize(info.logicalblocksize),
+    physicalblocksize(info.physicalblocksize),
+    minimumio(info.minimumio),
+    optimalio(info.optimalio),
+    alignmentoffset(info.alignmentoffset),
+    rotational(info.rotational) {
+    name.swap(info.name);
+    label.swap(info.label);
+    fstype.swap(info.fstype);
+    fsuuid.swap(info.fsuuid);
 }
 
 QString KDiskInfo::fancyName() const {
@@ -50,16 +282,19 @@ QString KDiskInfo::fancyName() const {
 }
 
 QString KDiskInfo::fancySize() const {
-    if (size < 1) {
+    const qint64 kilobytes = (bytes > 0) ? (bytes / 1024) : qint64(size);
+    if (kilobytes < 1) {
         return QString("unknown");
     }
 
-    if (size < 999) {
-        return QString("%1 Kb").arg(size);
-    } else if (size < 999999) {
-        return QString("%1 Mb").arg(size / 1000);
+    if (kilobytes < 999) {
+        return QString("%1 Kb").arg(kilobytes);
+    } else if (kilobytes < 999999) {
+        return QString("%1 Mb").arg(kilobytes / 1000);
+    } else if (kilobytes < 999999999) {
+        return QString("%1 Gb").arg(kilobytes / 1000000);
     } else {
-        return QString("%1 Gb").arg(size / 1000000);
+        return QString("%1 Tb").arg(kilobytes / 1000000000);
     }
 
     Q_UNREACHABLE();
@@ -101,6 +336,30 @@ KDiskInfo& KDiskInfo::operator=(const KDiskInfo &info) {
     fsuuid = info.fsuuid;
     size = info.size;
     type = info.type;
+    bytes = info.bytes;
+    logicalblocksize = info.logicalblocksize;
+    physicalblocksize = info.physicalblocksize;
+    minimumio = info.minimumio;
+    optimalio = info.optimalio;
+    alignmentoffset = info.alignmentoffset;
+    rotational = info.rotational;
+    return *this;
+}
+
+KDiskInfo& KDiskInfo::operator=(KDiskInfo &&info) {
+    name.swap(info.name);
+    label.swap(info.label);
+    fstype.swap(info.fstype);
+    fsuuid.swap(info.fsuuid);
+    size = info.size;
+    type = info.type;
+    bytes = info.bytes;
+    logicalblocksize = info.logicalblocksize;
+    physicalblocksize = info.physicalblocksize;
+    minimumio = info.minimumio;
+    optimalio = info.optimalio;
+    alignmentoffset = info.alignmentoffset;
+    rotational = info.rotational;
     return *this;
 }
 
@@ -113,6 +372,8 @@ QDebug operator<<(QDebug d, const KDiskInfo &disk)
         << ", fsuuid:" << disk.fsuuid
         << ", size:" << disk.fancySize()
         << ", type:" << disk.fancyType()
+        << ", bytes:" << disk.bytes
+        << ", rotational:" << disk.rotational
         << ")";
     return d;
 }
@@ -120,10 +381,10 @@ QDebug operator<<(QDebug d, const KDiskInfo &disk)
 
 const QDBusArgument &operator<<(QDBusArgument &argument, const KDiskInfo &disk) {
     argument.beginStructure();
-    argument << QString(disk.name);
-    argument << QString(disk.label);
-    argument << QString(disk.fstype);
-    argument << QString(disk.fsuuid);
+    argument << QString::fromUtf8(disk.name.constData(), disk.name.size());
+    argument << QString::fromUtf8(disk.label.constData(), disk.label.size());
+    argument << filesystemString(disk.fstype);
+    argument << QString::fromUtf8(disk.fsuuid.constData(), disk.fsuuid.size());
     argument << disk.size;
     argument << int(disk.type);
     argument.endStructure();
@@ -131,12 +392,18 @@ const QDBusArgument &operator<<(QDBusArgument &argument, const KDiskInfo &disk)
 }
 
 const QDBusArgument &operator>>(const QDBusArgument &argument, KDiskInfo &disk) {
+    // the fields are marshalled as strings, not as byte arrays
+    QString stringbuff;
     int typebuff;
     argument.beginStructure();
-    argument >> disk.name;
-    argument >> disk.label;
-    argument >> disk.fstype;
-    argument >> disk.fsuuid;
+    argument >> stringbuff;
+    disk.name = stringbuff.toUtf8();
+    argument >> stringbuff;
+    disk.label = stringbuff.toUtf8();
+    argument >> stringbuff;
+    disk.fstype = internFilesystem(stringbuff);
+    argument >> stringbuff;
+    disk.fsuuid = stringbuff.toUtf8();
     argument >> disk.size;
     argument >> typebuff;
     disk.type = KDiskInfo::KDiskType(typebuff);
@@ -145,314 +412,3071 @@ const QDBusArgument &operator>>(const QDBusArgument &argument, KDiskInfo &disk)
     return argument;
 }
 
-class KDiskManagerPrivate : public QObject {
-    Q_OBJECT
+KDiskInfoV2::KDiskInfoV2() {
+}
 
-    public:
-        KDiskManagerPrivate(QObject *parent = Q_NULLPTR);
-        ~KDiskManagerPrivate();
+KDiskInfoV2::KDiskInfoV2(const KDiskInfo &info)
+    : info(info) {
+}
 
-        QList<KDiskInfo> m_disks;
+const QDBusArgument &operator<<(QDBusArgument &argument, const KDiskInfoV2 &disk) {
+    const KDiskInfo &info = disk.info;
+    argument.beginStructure();
+    argument << QString::fromUtf8(info.name.constData(), info.name.size());
+    argument << QString::fromUtf8(info.label.constData(), info.label.size());
+    argument << filesystemString(info.fstype);
+    argument << QString::fromUtf8(info.fsuuid.constData(), info.fsuuid.size());
+    argument << info.size;
+    argument << int(info.type);
+    argument << info.bytes;
+    argument << info.logicalblocksize;
+    argument << info.physicalblocksize;
+    argument << info.minimumio;
+    argument << info.optimalio;
+    argument << info.alignmentoffset;
+    argument << info.rotational;
+    argument.endStructure();
+    return argument;
+}
 
-        KDiskInfo info(const QString &disk);
-        bool call(const QString &method, const QString &argument);
+const QDBusArgument &operator>>(const QDBusArgument &argument, KDiskInfoV2 &disk) {
+    KDiskInfo &info = disk.info;
+    QString stringbuff;
+    int typebuff;
+    argument.beginStructure();
+    argument >> stringbuff;
+    info.name = stringbuff.toUtf8();
+    argument >> stringbuff;
+    info.label = stringbuff.toUtf8();
+    argument >> stringbuff;
+    info.fstype = internFilesystem(stringbuff);
+    argument >> stringbuff;
+    info.fsuuid = stringbuff.toUtf8();
+    argument >> info.size;
+    argument >> typebuff;
+    info.type = KDiskInfo::KDiskType(typebuff);
+    argument >> info.bytes;
+    argument >> info.logicalblocksize;
+    argument >> info.physicalblocksize;
+    argument >> info.minimumio;
+    argument >> info.optimalio;
+    argument >> info.alignmentoffset;
+    argument >> info.rotational;
+    argument.endStructure();
 
-    Q_SIGNALS:
-        void addedDisk(const KDiskInfo &disk);
-        void changedDisk(const KDiskInfo &disk);
-        void removedDisk(const KDiskInfo &disk);
+    return argument;
+}
 
-    protected:
-        // reimplementation
-        void timerEvent(QTimerEvent *event);
+KDiskStats::KDiskStats()
+    : timestamp(0),
+    readiops(0.0),
+    writeiops(0.0),
+    readbytes(0.0),
+    writebytes(0.0),
+    queuedepth(0.0),
+    utilization(0.0) {
+}
 
-    private:
-        udev *m_udev;
-        udev_monitor *m_monitor;
-        QDBusInterface *m_interface;
-};
-Q_GLOBAL_STATIC(KDiskManagerPrivate, diskManager);
+#ifndef QT_NO_DEBUG_STREAM
+QDebug operator<<(QDebug d, const KDiskStats &stats)
+{
+    d << "KDiskStats( name:" << stats.name
+        << ", timestamp:" << stats.timestamp
+        << ", readiops:" << stats.readiops
+        << ", writeiops:" << stats.writeiops
+        << ", readbytes:" << stats.readbytes
+        << ", writebytes:" << stats.writebytes
+        << ", queuedepth:" << stats.queuedepth
+        << ", utilization:" << stats.utilization
+        << ")";
+    return d;
+}
+#endif
 
-KDiskManagerPrivate::KDiskManagerPrivate(QObject *parent)
-    : QObject(parent),
-    m_udev(Q_NULLPTR),
-    m_monitor(Q_NULLPTR),
-    m_interface(Q_NULLPTR) {
-    qRegisterMetaType<KDiskInfo>();
-    qRegisterMetaType<QList<KDiskInfo> >();
-    qDBusRegisterMetaType<KDiskInfo>();
-    qDBusRegisterMetaType<QList<KDiskInfo> >();
+const QDBusArgument &operator<<(QDBusArgument &argument, const KDiskStats &stats) {
+    argument.beginStructure();
+    argument << QString(stats.name);
+    argument << stats.timestamp;
+    argument << stats.readiops;
+    argument << stats.writeiops;
+    argument << stats.readbytes;
+    argument << stats.writebytes;
+    argument << stats.queuedepth;
+    argument << stats.utilization;
+    argument.endStructure();
+    return argument;
+}
 
-    m_udev = udev_new();
-    if (m_udev) {
-        m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+const QDBusArgument &operator>>(const QDBusArgument &argument, KDiskStats &stats) {
+    QString namebuff;
+    argument.beginStructure();
+    argument >> namebuff;
+    stats.name = namebuff.toUtf8();
+    argument >> stats.timestamp;
+    argument >> stats.readiops;
+    argument >> stats.writeiops;
+    argument >> stats.readbytes;
+    argument >> stats.writebytes;
+    argument >> stats.queuedepth;
+    argument >> stats.utilization;
+    argument.endStructure();
 
-        if (m_monitor) {
-            udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "block", Q_NULLPTR);
-            udev_monitor_enable_receiving(m_monitor);
-        }
+    return argument;
+}
 
+KDiskUsage::KDiskUsage()
+    : timestamp(0),
+    size(0),
+    used(0),
+    available(0),
+    files(0),
+    freefiles(0) {
+}
 
-        const QDir dir("/sys/class/block");
-        foreach (const QString &entry, dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
-            const KDiskInfo di = info(entry);
-            if (!di.isNull()) {
-                m_disks.append(di);
-            }
-        }
+int KDiskUsage::percent() const {
+    const qint64 total = used + available;
+    if (total <= 0) {
+        return 0;
     }
+    return int((used * 100 + total - 1) / total);
+}
 
-    if (!m_udev || !m_monitor) {
-        qWarning() << "could not setup disk monitor";
-    } else {
-        startTimer(1000);
+#ifndef QT_NO_DEBUG_STREAM
+QDebug operator<<(QDebug d, const KDiskUsage &usage)
+{
+    d << "KDiskUsage( name:" << usage.name
+        << ", mountpoint:" << usage.mountpoint
+        << ", timestamp:" << usage.timestamp
+        << ", size:" << usage.size
+        << ", used:" << usage.used
+        << ", available:" << usage.available
+        << ", files:" << usage.files
+        << ", freefiles:" << usage.freefiles
+        << ")";
+    return d;
+}
+#endif
+
+const QDBusArgument &operator<<(QDBusArgument &argument, const KDiskUsage &usage) {
+    argument.beginStructure();
+    argument << QString(usage.name);
+    argument << QString(usage.mountpoint);
+    argument << usage.timestamp;
+    argument << usage.size;
+    argument << usage.used;
+    argument << usage.available;
+    argument << usage.files;
+    argument << usage.freefiles;
+    argument.endStructure();
+    return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, KDiskUsage &usage) {
+    QString namebuff;
+    QString mountpointbuff;
+    argument.beginStructure();
+    argument >> namebuff;
+    usage.name = namebuff.toUtf8();
+    argument >> mountpointbuff;
+    usage.mountpoint = mountpointbuff.toUtf8();
+    argument >> usage.timestamp;
+    argument >> usage.size;
+    argument >> usage.used;
+    argument >> usage.available;
+    argument >> usage.files;
+    argument >> usage.freefiles;
+    argument.endStructure();
+
+    return argument;
+}
+
+// metrics form a list that is only ever prepended to, the exporter walks it without locking
+static std::atomic<KDiskMetric*> s_metrics(Q_NULLPTR);
+static const qint64 s_metricbuckets[] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 10000000, 60000000
+};
+
+static KDiskMetric s_receivedevents("kblockd_events_received_total",
+    "Number of udev events received", KDiskMetric::Counter);
+static KDiskMetric s_emittedevents("kblockd_events_emitted_total",
+    "Number of disk signals emitted", KDiskMetric::Counter);
+static KDiskMetric s_resyncs("kblockd_resyncs_total",
+    "Number of resynchronizations after the udev event buffer overflowed", KDiskMetric::Counter);
+static KDiskMetric s_eventseconds("kblockd_event_seconds",
+    "Time to process udev event", KDiskMetric::Histogram);
+static KDiskMetric s_flushseconds("kblockd_change_flush_seconds",
+    "Time to process coalesced change events when the quiet window timer fires", KDiskMetric::Histogram);
+static KDiskMetric s_disksgauge("kblockd_disks",
+    "Number of tracked disks", KDiskMetric::Gauge);
+static KDiskMetric s_mountsgauge("kblockd_mounts",
+    "Number of mounted devices", KDiskMetric::Gauge);
+static KDiskMetric s_infoseconds("kblockd_info_seconds",
+    "Time to look up disk information", KDiskMetric::Histogram);
+static KDiskMetric s_mountpointseconds("kblockd_mountpoint_seconds",
+    "Time to look up mount point of disk", KDiskMetric::Histogram);
+static KDiskMetric s_mountseconds("kblockd_mount_seconds",
+    "Time to mount disk", KDiskMetric::Histogram);
+static KDiskMetric s_mountfailures("kblockd_mount_failures_total",
+    "Number of failed mounts", KDiskMetric::Counter);
+static KDiskMetric s_unmountseconds("kblockd_unmount_seconds",
+    "Time to unmount disk", KDiskMetric::Histogram);
+static KDiskMetric s_unmountfailures("kblockd_unmount_failures_total",
+    "Number of failed unmounts", KDiskMetric::Counter);
+static KDiskMetric s_fsckseconds("kblockd_job_seconds",
+    "Duration of disk jobs", KDiskMetric::Histogram, "job=\"fsck\"");
+static KDiskMetric s_mkfsseconds("kblockd_job_seconds",
+    "Duration of disk jobs", KDiskMetric::Histogram, "job=\"mkfs\"");
+static KDiskMetric s_rescanseconds("kblockd_job_seconds",
+    "Duration of disk jobs", KDiskMetric::Histogram, "job=\"rescan\"");
+static KDiskMetric s_fsckfailures("kblockd_job_failures_total",
+    "Number of failed disk jobs", KDiskMetric::Counter, "job=\"fsck\"");
+static KDiskMetric s_mkfsfailures("kblockd_job_failures_total",
+    "Number of failed disk jobs", KDiskMetric::Counter, "job=\"mkfs\"");
+static KDiskMetric s_rescanfailures("kblockd_job_failures_total",
+    "Number of failed disk jobs", KDiskMetric::Counter, "job=\"rescan\"");
+
+KDiskMetric::KDiskMetric(const char *name, const char *help, const KMetricType type,
+                         const char *labels)
+    : m_name(name),
+    m_help(help),
+    m_labels(labels),
+    m_type(type),
+    m_value(0),
+    m_sum(0),
+    m_next(Q_NULLPTR) {
+    for (int i = 0; i < BucketCount; i++) {
+        m_buckets[i] = 0;
     }
 
-    const QDBusConnection connection = QDBusConnection::systemBus();
-    if (connection.isConnected()) {
-        m_interface = new QDBusInterface("com.kblockd.Block",
-            "/com/kblockd/Block", "com.kblockd.Block", connection);
-    } else {
-        qWarning() << "Cannot connect to the D-Bus session bus";
+    m_next = s_metrics.load();
+    while (!s_metrics.compare_exchange_weak(m_next, this)) {
     }
 }
 
-KDiskManagerPrivate::~KDiskManagerPrivate() {
-    if (m_interface) {
-        m_interface->deleteLater();
+void KDiskMetric::add(const qint64 value) {
+    m_value.fetch_add(value, std::memory_order_relaxed);
+}
+
+void KDiskMetric::set(const qint64 value) {
+    m_value.store(value, std::memory_order_relaxed);
+}
+
+void KDiskMetric::observe(const qint64 usecs) {
+    int bucket = 0;
+    while (bucket < BucketCount - 1 && usecs > s_metricbuckets[bucket]) {
+        bucket++;
     }
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(usecs, std::memory_order_relaxed);
+    m_value.fetch_add(1, std::memory_order_relaxed);
+}
 
-    udev_unref(m_udev);
-    udev_monitor_unref(m_monitor);
+qint64 KDiskMetric::value() const {
+    return m_value.load(std::memory_order_relaxed);
 }
 
-KDiskInfo KDiskManagerPrivate::info(const QString &disk) {
-    KDiskInfo result;
+KDiskMetricTimer::KDiskMetricTimer(KDiskMetric &metric)
+    : m_metric(metric) {
+    m_timer.start();
+}
 
-    if (!m_udev) {
-        qWarning() << "cannot get info for device because no udev";
-        return result;
-    }
+KDiskMetricTimer::~KDiskMetricTimer() {
+    m_metric.observe(m_timer.nsecsElapsed() / 1000);
+}
 
-    const QFileInfo devinfo = QFileInfo(disk);
-    const QByteArray path = "/sys/class/block/" + devinfo.fileName().toUtf8();
+// output of the job commands kept in memory, fsck can be very verbose
+static const int s_outputlimit = 64 * 1024;
+static const int s_errorlimit = 4 * 1024;
 
-    udev_device *dev = udev_device_new_from_syspath(m_udev, path);
-    if (dev) {
-        result.name = udev_device_get_property_value(dev, "DEVNAME");
-        result.label = udev_device_get_property_value(dev, "ID_FS_LABEL");
-        result.fstype = udev_device_get_property_value(dev, "ID_FS_TYPE");
-        result.fsuuid = udev_device_get_property_value(dev, "ID_FS_UUID");
-        const QByteArray devtype = udev_device_get_property_value(dev, "DEVTYPE");
-        if (devtype == "disk") {
-            result.type = KDiskInfo::KDiskType::Disk;
-        } else if (devtype == "partition") {
-            result.type = KDiskInfo::KDiskType::Partition;
-        }
-        const QByteArray size = udev_device_get_property_value(dev, "ID_PART_ENTRY_SIZE");
-        result.size = size.toInt() / 2;
-    } else {
-        qWarning() << "cannot get info for device because no dev for" << disk;
+// appends data to ring buffer, discarding the oldest data past the limit
+static void appendBounded(QByteArray &buffer, const QByteArray &data, const int limit) {
+    buffer.append(data);
+    if (buffer.size() > limit) {
+        buffer.remove(0, buffer.size() - limit);
     }
+}
 
-    udev_device_unref(dev);
+// program of the job steps that discard the device in-process, it is never executed
+static const QString s_discardstep = QString::fromLatin1("kblockd-discard");
 
-    return result;
+// discards the whole device a gigabyte at a time so that other I/O is not starved meanwhile
+class KDiskDiscarder : public QThread {
+    Q_OBJECT
+
+    public:
+        KDiskDiscarder(const QByteArray &device, QObject *parent);
+
+        QString errorString() const;
+
+    Q_SIGNALS:
+        void progress(int percent);
+
+    protected:
+        // reimplementation
+        void run();
+
+    private:
+        const QByteArray m_device;
+        QString m_error;
+};
+
+KDiskDiscarder::KDiskDiscarder(const QByteArray &device, QObject *parent)
+    : QThread(parent),
+    m_device(device) {
 }
 
-bool KDiskManagerPrivate::call(const QString &method, const QString &argument) {
-    if (m_interface && m_interface->isValid()) {
-        const QDBusMessage result = m_interface->call(method, argument);
-        QDBusReply<bool> reply = QDBusReply<bool>(result);
-        if (reply.isValid()) {
-            return reply.value();
-        } else {
-            qWarning() << reply.error().message();
-            return false;
+QString KDiskDiscarder::errorString() const {
+    return m_error;
+}
+
+void KDiskDiscarder::run() {
+    const int fd = ::open(m_device.constData(), O_WRONLY | O_CLOEXEC | O_EXCL);
+    if (fd == -1) {
+        m_error = QString("could not open %1: %2").arg(QFile::decodeName(m_device), qt_error_string(errno));
+        return;
+    }
+
+    quint64 size = 0;
+    if (::ioctl(fd, BLKGETSIZE64, &size) != 0) {
+        m_error = QString("could not get size of %1: %2").arg(QFile::decodeName(m_device), qt_error_string(errno));
+        ::close(fd);
+        return;
+    }
+
+    const quint64 step = Q_UINT64_C(1073741824);
+    for (quint64 offset = 0; offset < size; offset += step) {
+        quint64 range[2] = { offset, qMin(step, size - offset) };
+        if (::ioctl(fd, BLKDISCARD, range) != 0) {
+            m_error = QString("could not discard %1: %2").arg(QFile::decodeName(m_device), qt_error_string(errno));
+            break;
         }
-    } else {
-        qWarning() << QDBusConnection::systemBus().lastError().message();
-        return false;
+        emit progress(int((offset + range[1]) * 100 / size));
     }
+    ::close(fd);
 }
 
-void KDiskManagerPrivate::timerEvent(QTimerEvent *event) {
-    udev_device *dev = udev_monitor_receive_device(m_monitor);
-    while (dev) {
-        const char* name = udev_device_get_property_value(dev, "DEVNAME");
-        const char* action = udev_device_get_action(dev);
+// relative duration of e2fsck passes, pass 1 takes most of the time
+static const int s_fsckpassweights[] = { 0, 70, 20, 2, 5, 3 };
 
-        if (qstrcmp(action, "add") == 0) {
-            const KDiskInfo info = KDiskManagerPrivate::info(name);
-            if (!info.isNull()) {
-                qDebug() << "added" << name;
-                m_disks.append(info);
-                emit addedDisk(info);
-            }
-        } else if (qstrcmp(action, "change") == 0) {
-            const KDiskInfo info = KDiskManagerPrivate::info(name);
-            if (!info.isNull()) {
-                qDebug() << "changed" << name;
-                m_disks.removeAll(info);
-                m_disks.append(info);
-                emit changedDisk(info);
-            }
-        } else if (qstrcmp(action, "remove") == 0) {
-            /*
-                reusing disk info from already tracked disks since info cannot be obtained once
-                the device is gone
-            */
-            foreach (const KDiskInfo &info, m_disks) {
-                if (info.name == name) {
-                    qDebug() << "removed" << name;
-                    m_disks.removeAll(info);
-                    emit removedDisk(info);
-                    break;
-                }
-            }
-        } else if (qstrcmp(action, "bind") != 0 && qstrcmp(action, "unbind") != 0) {
-            // bind/unbind are driver changing for device type of event
-            qWarning() << "unknown action" << action;
-        }
+KDiskJob::KDiskJob(const QList<QStringList> &commands, const QString &error)
+    : QObject(Q_NULLPTR),
+    m_commands(commands),
+    m_step(0),
+    m_process(Q_NULLPTR),
+    m_discarder(Q_NULLPTR),
+    m_percent(0),
+    m_durationmetric(Q_NULLPTR),
+    m_failuremetric(Q_NULLPTR),
+    m_error(error),
+    m_finished(false),
+    m_result(false),
+    m_autodelete(true) {
+    m_process = new QProcess(this);
+    connect(m_process, SIGNAL(finished(int,QProcess::ExitStatus)),
+        this, SLOT(processFinished(int,QProcess::ExitStatus)));
+    connect(m_process, SIGNAL(error(QProcess::ProcessError)),
+        this, SLOT(processError(QProcess::ProcessError)));
+    connect(m_process, SIGNAL(readyReadStandardOutput()), this, SLOT(processOutput()));
+    connect(m_process, SIGNAL(readyReadStandardError()), this, SLOT(processErrorOutput()));
 
-        dev = udev_monitor_receive_device(m_monitor);
+    QTimer::singleShot(0, this, SLOT(start()));
+}
+
+KDiskJob::~KDiskJob() {
+    if (m_process->state() != QProcess::NotRunning) {
+        qWarning() << "job destroyed while running" << m_commands.at(m_step).first();
+        m_process->kill();
+        m_process->waitForFinished(-1);
     }
-    udev_device_unref(dev);
+    if (m_discarder) {
+        // discarding cannot be interrupted, the current chunk is short anyway
+        m_discarder->wait();
+    }
+}
 
-    event->ignore();
+bool KDiskJob::isFinished() const {
+    return m_finished;
 }
 
-KDiskManager::KDiskManager(QObject *parent)
-    : QObject(parent) {
-    connect(diskManager(), SIGNAL(addedDisk(KDiskInfo)),
-        this, SLOT(emitAdded(KDiskInfo)));
-    connect(diskManager(), SIGNAL(changedDisk(KDiskInfo)),
-        this, SLOT(emitChanged(KDiskInfo)));
-    connect(diskManager(), SIGNAL(removedDisk(KDiskInfo)),
-        this, SLOT(emitRemoved(KDiskInfo)));
+bool KDiskJob::result() const {
+    return m_result;
 }
 
-QStringList KDiskManager::supported() {
-    QStringList result;
-    foreach (const QString &fstype, s_knownfstypes) {
-        if (!QStandardPaths::findExecutable("fsck." + fstype).isEmpty()
-            && !QStandardPaths::findExecutable("mkfs." + fstype).isEmpty()) {
-            result << fstype;
-        }
+QString KDiskJob::errorString() const {
+    return m_error;
+}
+
+int KDiskJob::percent() const {
+    return m_percent;
+}
+
+int KDiskJob::eta() const {
+    if (m_finished) {
+        return 0;
     }
-    if (!QStandardPaths::findExecutable("mkswap").isEmpty()) {
-        result << "swap";
+    if (m_percent <= 0 || !m_timer.isValid()) {
+        return -1;
     }
-    return result;
+    const qint64 elapsed = m_timer.elapsed();
+    return (elapsed * (100 - m_percent) / m_percent) / 1000;
 }
 
-QList<KDiskInfo> KDiskManager::disks() {
-    return diskManager()->m_disks;
+QByteArray KDiskJob::output() const {
+    return m_output;
 }
 
-KDiskInfo KDiskManager::info(const QString &disk) {
-    return diskManager()->info(disk);
+bool KDiskJob::autoDelete() const {
+    return m_autodelete;
 }
 
-bool KDiskManager::mounted(const QString &disk) {
-    return !mountpoint(disk).isEmpty();
+void KDiskJob::setAutoDelete(const bool autodelete) {
+    m_autodelete = autodelete;
 }
 
-QString KDiskManager::mountpoint(const QString &disk) {
-    QString result;
-
-    QFile mounts("/proc/mounts");
-    if (!mounts.open(QFile::ReadOnly)) {
-        qWarning() << "cannot open /proc/mounts";
-        return result;
+void KDiskJob::start() {
+    if (!m_error.isEmpty()) {
+        finish(false);
+        return;
     }
 
-    const QRegExp pattern = QRegExp("^" + disk + "\\s");
-    while (true) {
-        const QString line = mounts.readLine();
-        if (pattern.indexIn(line) >= 0) {
-            result = line.split(" ").at(1);
-        }
+    m_timer.start();
+    emit progress(0);
+    next();
+}
 
-        if (mounts.atEnd()) {
-            break;
+void KDiskJob::processFinished(int exitcode, QProcess::ExitStatus exitstatus) {
+    // anything left in the pipes was not signaled yet
+    processOutput();
+    processErrorOutput();
+
+    if (exitstatus != QProcess::NormalExit || exitcode != 0) {
+        m_error = m_errors.trimmed();
+        if (m_error.isEmpty()) {
+            m_error = QString("%1 exited with code %2").arg(m_commands.at(m_step).first()).arg(exitcode);
         }
+        finish(false);
+        return;
     }
 
-    return result;
+    m_step++;
+    m_partial.clear();
+    setStepProgress(0);
+    next();
 }
 
-bool KDiskManager::rescan() {
-    qDebug() << "scanning for disk changes";
+void KDiskJob::processOutput() {
+    const QByteArray data = m_process->readAllStandardOutput();
+    if (data.isEmpty()) {
+        return;
+    }
+    appendBounded(m_output, data, s_outputlimit);
 
-    // partprobe is part of parted
-    const QString partprobe = QStandardPaths::findExecutable("partprobe");
-    // partx is part of util-linux
-    const QString partx = QStandardPaths::findExecutable("partx");
-    foreach (const KDiskInfo &disk, disks()) {
-        if (disk.type == KDiskInfo::KDiskType::Partition) {
-            continue;
+    // progress is written as lines or redrawn in place with carriage return and backspaces
+    foreach (const char character, data) {
+        if (character == '\n' || character == '\r' || character == '\b') {
+            if (!m_partial.isEmpty()) {
+                parseProgress(m_partial);
+                m_partial.clear();
+            }
+        } else if (m_partial.size() < 256) {
+            m_partial.append(character);
         }
-        if (!partprobe.isEmpty()) {
-            QProcess partproc;
-            partproc.start(partprobe, QStringList() << disk.name);
-            partproc.waitForFinished(-1);
-            if (partproc.exitCode() != 0) {
-                qWarning() << partproc.readAllStandardError();
-                return false;
+    }
+}
+
+void KDiskJob::processErrorOutput() {
+    const QByteArray data = m_process->readAllStandardError();
+    if (data.isEmpty()) {
+        return;
+    }
+    appendBounded(m_output, data, s_outputlimit);
+    appendBounded(m_errors, data, s_errorlimit);
+}
+
+void KDiskJob::parseProgress(const QByteArray &line) {
+    // fsck -C with descriptor other than 0 writes "pass current max device"
+    static const QRegExp fsckprogress("^(\\d+) (\\d+) (\\d+) \\S+$");
+    // mke2fs writes "Writing inode tables: current/max"
+    static const QRegExp mkfsprogress("(\\d+)/(\\d+)\\s*$");
+
+    QRegExp fsckmatch(fsckprogress);
+    QRegExp mkfsmatch(mkfsprogress);
+    if (fsckmatch.indexIn(line) != -1) {
+        const int pass = fsckmatch.cap(1).toInt();
+        const qint64 current = fsckmatch.cap(2).toLongLong();
+        const qint64 max = fsckmatch.cap(3).toLongLong();
+        if (pass < 1 || pass > 5 || max <= 0) {
+            return;
+        }
+        int percent = 0;
+        for (int i = 1; i < pass; i++) {
+            percent += s_fsckpassweights[i];
+        }
+        percent += s_fsckpassweights[pass] * qMin(current, max) / max;
+        setStepProgress(percent);
+    } else if (mkfsmatch.indexIn(line) != -1) {
+        const qint64 current = mkfsmatch.cap(1).toLongLong();
+        const qint64 max = mkfsmatch.cap(2).toLongLong();
+        if (max <= 0) {
+            return;
+        }
+        setStepProgress(qMin(current, max) * 100 / max);
+    }
+}
+
+void KDiskJob::setStepProgress(const int percent) {
+    const int overall = (m_step * 100 + percent) / qMax(m_commands.size(), 1);
+    // mke2fs reports several phases, each counting from 0
+    if (overall <= m_percent || overall > 100) {
+        return;
+    }
+    m_percent = overall;
+    emit progress(m_percent);
+}
+
+void KDiskJob::processError(QProcess::ProcessError error) {
+    // the finished signal is emitted for all other errors
+    if (error == QProcess::FailedToStart) {
+        m_error = m_process->errorString();
+        finish(false);
+    }
+}
+
+void KDiskJob::next() {
+    if (m_step >= m_commands.size()) {
+        finish(true);
+        return;
+    }
+
+    QStringList arguments = m_commands.at(m_step);
+    const QString program = arguments.takeFirst();
+    if (program == s_discardstep) {
+        m_discarder = new KDiskDiscarder(QFile::encodeName(arguments.first()), this);
+        connect(m_discarder, SIGNAL(progress(int)), this, SLOT(discardProgress(int)));
+        connect(m_discarder, SIGNAL(finished()), this, SLOT(discardFinished()));
+        m_discarder->start();
+        return;
+    }
+    m_process->start(program, arguments);
+}
+
+void KDiskJob::discardProgress(int percent) {
+    setStepProgress(percent);
+}
+
+void KDiskJob::discardFinished() {
+    const QString error = m_discarder->errorString();
+    m_discarder->deleteLater();
+    m_discarder = Q_NULLPTR;
+
+    if (!error.isEmpty()) {
+        m_error = error;
+        finish(false);
+        return;
+    }
+
+    m_step++;
+    setStepProgress(0);
+    next();
+}
+
+void KDiskJob::setMetrics(KDiskMetric *duration, KDiskMetric *failures) {
+    m_durationmetric = duration;
+    m_failuremetric = failures;
+}
+
+void KDiskJob::finish(const bool result) {
+    m_finished = true;
+    m_result = result;
+    if (m_durationmetric && m_timer.isValid()) {
+        m_durationmetric->observe(m_timer.nsecsElapsed() / 1000);
+    }
+    if (!result && m_failuremetric) {
+        m_failuremetric->add();
+    }
+    if (!result) {
+        qWarning() << m_error;
+        emit error(m_error);
+    }
+    emit finished(result);
+
+    if (m_autodelete) {
+        deleteLater();
+    }
+}
+
+// waits for the job without spinning, the event loop sleeps until the process signals
+static bool execJob(KDiskJob *job) {
+    job->setAutoDelete(false);
+    QEventLoop loop;
+    QObject::connect(job, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+    loop.exec();
+    const bool result = job->result();
+    delete job;
+    return result;
+}
+
+// the disk of partition, empty string for whole disks
+static QString diskParent(const QString &disk) {
+    const QFileInfo sysinfo(s_systemroot + "/sys/class/block/" + QFileInfo(disk).fileName());
+    if (QFile::exists(sysinfo.filePath() + "/partition")) {
+        // the sysfs entry of partition is a directory in the sysfs entry of the disk
+        return QFileInfo(sysinfo.canonicalFilePath()).dir().dirName();
+    }
+    return QString();
+}
+
+// whole disks backing the device, partitions and stacked (dm, md) devices resolve to them
+static QSet<QByteArray> diskSpindles(const QByteArray &disk) {
+    QSet<QByteArray> result;
+
+    QString whole = diskParent(disk);
+    if (whole.isEmpty()) {
+        whole = QFileInfo(disk).fileName();
+    }
+
+    const QDir slaves(s_systemroot + "/sys/class/block/" + whole + "/slaves");
+    const QStringList slavenames = slaves.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    if (slavenames.isEmpty()) {
+        result.insert(whole.toUtf8());
+        return result;
+    }
+    foreach (const QString &slave, slavenames) {
+        result.unite(diskSpindles(slave.toUtf8()));
+    }
+    return result;
+}
+
+typedef KDiskJob* (*KDiskJobFactory)(const KDiskInfo &disk);
+
+/*
+    runs jobs for multiple disks with bounded concurrency, disks sharing spindles are not
+    processed at the same time to avoid seek storms
+*/
+class KDiskBatch : public QObject {
+    Q_OBJECT
+
+    public:
+        KDiskBatch(KDiskJobFactory factory, const QList<KDiskInfo> &disks, const int concurrency);
+
+        QMap<QString, bool> exec();
+
+    private Q_SLOTS:
+        void jobFinished(bool result);
+
+    private:
+        void schedule();
+
+        KDiskJobFactory m_factory;
+        int m_concurrency;
+        QList<KDiskInfo> m_pending;
+        QHash<KDiskJob*, KDiskInfo> m_running;
+        QHash<QByteArray, QSet<QByteArray> > m_spindles;
+        QSet<QByteArray> m_busy;
+        QMap<QString, bool> m_results;
+        QEventLoop m_loop;
+};
+
+KDiskBatch::KDiskBatch(KDiskJobFactory factory, const QList<KDiskInfo> &disks, const int concurrency)
+    : QObject(Q_NULLPTR),
+    m_factory(factory),
+    m_concurrency(concurrency),
+    m_pending(disks) {
+    if (m_concurrency < 1) {
+        m_concurrency = QThread::idealThreadCount();
+    }
+    if (m_concurrency < 1) {
+        m_concurrency = 1;
+    }
+
+    foreach (const KDiskInfo &disk, disks) {
+        m_spindles.insert(disk.name, diskSpindles(disk.name));
+    }
+}
+
+QMap<QString, bool> KDiskBatch::exec() {
+    schedule();
+    if (!m_running.isEmpty()) {
+        m_loop.exec();
+    }
+    return m_results;
+}
+
+void KDiskBatch::jobFinished(bool result) {
+    KDiskJob *job = qobject_cast<KDiskJob*>(sender());
+    const KDiskInfo disk = m_running.take(job);
+    m_results.insert(disk.name, result);
+    m_busy.subtract(m_spindles.value(disk.name));
+
+    schedule();
+    if (m_running.isEmpty()) {
+        m_loop.quit();
+    }
+}
+
+void KDiskBatch::schedule() {
+    QList<KDiskInfo>::iterator it = m_pending.begin();
+    while (it != m_pending.end() && m_running.size() < m_concurrency) {
+        const QSet<QByteArray> spindles = m_spindles.value(it->name);
+        bool busy = false;
+        foreach (const QByteArray &spindle, spindles) {
+            if (m_busy.contains(spindle)) {
+                busy = true;
+                break;
+            }
+        }
+        if (busy) {
+            ++it;
+            continue;
+        }
+
+        KDiskJob *job = m_factory(*it);
+        connect(job, SIGNAL(finished(bool)), this, SLOT(jobFinished(bool)));
+        m_running.insert(job, *it);
+        m_busy.unite(spindles);
+        it = m_pending.erase(it);
+    }
+}
+
+static KDiskJob* rescanDiskJob(const KDiskInfo &disk) {
+    return KDiskManager::rescanJob(QList<KDiskInfo>() << disk);
+}
+
+// mount and unmount only wait for the kernel, a batch of them runs in a thread pool
+class KDiskMountTask : public QRunnable {
+    public:
+        KDiskMountTask(const KDiskInfo &disk, const QString &options, const bool mount);
+
+        // reimplementation
+        void run();
+
+        const KDiskInfo m_disk;
+        const QString m_options;
+        const bool m_mount;
+        bool m_result;
+};
+
+KDiskMountTask::KDiskMountTask(const KDiskInfo &disk, const QString &options, const bool mount)
+    : m_disk(disk),
+    m_options(options),
+    m_mount(mount),
+    m_result(false) {
+    setAutoDelete(false);
+}
+
+void KDiskMountTask::run() {
+    if (m_mount) {
+        m_result = KDiskManager::mount(m_disk, QString(), m_options);
+    } else {
+        m_result = KDiskManager::unmount(m_disk);
+    }
+}
+
+static QMap<QString, bool> runMountTasks(const QList<KDiskInfo> &disks, const QString &options,
+    const bool mount, const int concurrency) {
+    QThreadPool pool;
+    int threads = concurrency;
+    if (threads < 1) {
+        threads = QThread::idealThreadCount();
+    }
+    pool.setMaxThreadCount(qMax(threads, 1));
+
+    QList<KDiskMountTask*> tasks;
+    foreach (const KDiskInfo &disk, disks) {
+        KDiskMountTask *task = new KDiskMountTask(disk, options, mount);
+        tasks.append(task);
+        pool.start(task);
+    }
+    pool.waitForDone();
+
+    QMap<QString, bool> result;
+    foreach (KDiskMountTask *task, tasks) {
+        result.insert(task->m_disk.name, task->m_result);
+        delete task;
+    }
+    return result;
+}
+
+static const QStringList s_queueparameters = QStringList()
+        << "scheduler"
+        << "read_ahead_kb"
+        << "nr_requests"
+        << "max_sectors_kb"
+        << "rotational";
+
+static const QStringList s_queuecriteria = QStringList()
+        << "name"
+        << "rotational"
+        << "removable";
+
+// the queue of partition is the queue of its disk
+static QString queueDirectory(const QString &disk) {
+    QString whole = diskParent(disk);
+    if (whole.isEmpty()) {
+        whole = QFileInfo(disk).fileName();
+    }
+    return s_systemroot + "/sys/class/block/" + whole;
+}
+
+static QByteArray readSysfs(const QString &path) {
+    QFile file(path);
+    if (!file.open(QFile::ReadOnly)) {
+        return QByteArray();
+    }
+    return file.readAll().trimmed();
+}
+
+// reads the size and the I/O topology of the device, the queue is shared with the whole disk
+static void readTopology(KDiskInfo &disk) {
+    const QString devicedirectory = s_systemroot + "/sys/class/block/" + QFileInfo(disk.name).fileName();
+    const QString queuedirectory = queueDirectory(disk.name) + "/queue/";
+    // the size is in 512-byte sectors regardless of the logical block size of the device
+    disk.bytes = readSysfs(devicedirectory + "/size").toLongLong() * 512;
+    disk.size = int(qMin(disk.bytes / 1024, qint64(INT_MAX)));
+    disk.logicalblocksize = readSysfs(queuedirectory + "logical_block_size").toInt();
+    disk.physicalblocksize = readSysfs(queuedirectory + "physical_block_size").toInt();
+    disk.minimumio = readSysfs(queuedirectory + "minimum_io_size").toInt();
+    disk.optimalio = readSysfs(queuedirectory + "optimal_io_size").toInt();
+    disk.alignmentoffset = readSysfs(devicedirectory + "/alignment_offset").toInt();
+    disk.rotational = (readSysfs(queuedirectory + "rotational") == "1");
+}
+
+// criteria and settings are pairs of attribute and value, all criteria must match
+struct KDiskQueueRule {
+    QList<QPair<QString, QString> > criteria;
+    QList<QPair<QString, QString> > settings;
+};
+
+struct KMountFlag {
+    const char* name;
+    unsigned long flag;
+    bool set;
+};
+
+// the options not in the table are filesystem specific and passed as data
+static const KMountFlag s_mountflags[] = {
+    { "defaults", 0, true },
+    { "ro", MS_RDONLY, true },
+    { "rw", MS_RDONLY, false },
+    { "nosuid", MS_NOSUID, true },
+    { "suid", MS_NOSUID, false },
+    { "nodev", MS_NODEV, true },
+    { "dev", MS_NODEV, false },
+    { "noexec", MS_NOEXEC, true },
+    { "exec", MS_NOEXEC, false },
+    { "sync", MS_SYNCHRONOUS, true },
+    { "async", MS_SYNCHRONOUS, false },
+    { "dirsync", MS_DIRSYNC, true },
+    { "noatime", MS_NOATIME, true },
+    { "atime", MS_NOATIME, false },
+    { "nodiratime", MS_NODIRATIME, true },
+    { "diratime", MS_NODIRATIME, false },
+    { "relatime", MS_RELATIME, true },
+    { "norelatime", MS_RELATIME, false },
+    { "strictatime", MS_STRICTATIME, true },
+#ifdef MS_LAZYTIME
+    { "lazytime", MS_LAZYTIME, true },
+    { "nolazytime", MS_LAZYTIME, false },
+#endif
+    { Q_NULLPTR, 0, false }
+};
+
+// built-in mount profiles, keyed by filesystem type and then by profile name
+static QHash<QString, QMap<QString, QString> > defaultMountProfiles() {
+    QHash<QString, QMap<QString, QString> > result;
+    result["ext2"]["throughput"] = "noatime";
+    result["ext3"]["throughput"] = "noatime,commit=60";
+    result["ext4"]["throughput"] = "noatime,commit=60";
+    result["ext4"]["ssd"] = "noatime,discard";
+    result["xfs"]["large-file"] = "noatime,inode64,largeio,allocsize=64m";
+    result["xfs"]["ssd"] = "noatime,inode64,discard";
+    result["btrfs"]["throughput"] = "noatime,commit=60";
+    result["btrfs"]["ssd"] = "noatime,ssd,discard=async";
+    result["vfat"]["removable"] = "noatime,flush,utf8";
+    return result;
+}
+
+// devices that do not support discard have the maximum discard size of 0
+static bool discardSupported(const QString &disk) {
+    const QByteArray maxbytes = readSysfs(queueDirectory(disk) + "/queue/discard_max_bytes");
+    return (!maxbytes.isEmpty() && maxbytes != "0");
+}
+
+// trims range of the filesystem mounted on directory, returns the number of trimmed bytes
+static qint64 trimRange(const QByteArray &directory, const quint64 start, const quint64 length) {
+    const int fd = ::open(directory.constData(), O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+    if (fd == -1) {
+        qWarning() << "could not open" << directory << qt_error_string(errno);
+        return -1;
+    }
+
+    KTrimRange range;
+    range.start = start;
+    range.len = length;
+    range.minlen = 0;
+    const int rv = ::ioctl(fd, FITRIM, &range);
+    const int error = errno;
+    ::close(fd);
+    if (rv != 0) {
+        qWarning() << "could not trim" << directory << qt_error_string(error);
+        return -1;
+    }
+    // the kernel updates the length to the number of trimmed bytes
+    return range.len;
+}
+
+// little-endian fields of superblocks
+static quint16 superblock16(const uchar *data) {
+    return quint16(data[0]) | (quint16(data[1]) << 8);
+}
+
+static quint32 superblock32(const uchar *data) {
+    return quint32(superblock16(data)) | (quint32(superblock16(data + 2)) << 16);
+}
+
+static QByteArray superblockUuid(const uchar *data) {
+    const QByteArray hex = QByteArray(reinterpret_cast<const char*>(data), 16).toHex();
+    if (hex == QByteArray(32, '0')) {
+        return QByteArray();
+    }
+    return hex.mid(0, 8) + '-' + hex.mid(8, 4) + '-' + hex.mid(12, 4) + '-' + hex.mid(16, 4)
+        + '-' + hex.mid(20, 12);
+}
+
+static QByteArray superblockLabel(const uchar *data, const int size) {
+    QByteArray result(reinterpret_cast<const char*>(data), size);
+    const int terminator = result.indexOf('\0');
+    if (terminator >= 0) {
+        result.truncate(terminator);
+    }
+    return result.trimmed();
+}
+
+static bool readSuperblock(const int fd, const off_t offset, uchar *buffer, const size_t size) {
+    ssize_t count = -1;
+    do {
+        count = ::pread(fd, buffer, size, offset);
+    } while (count == -1 && errno == EINTR);
+    return (count == ssize_t(size));
+}
+
+/*
+    reads the filesystem type, UUID and label from the superblock of the known filesystems in
+    the same format blkid reports them, minix has no UUID and is not probed. The first 4 KiB
+    hold the superblocks of ext, xfs, vfat and ntfs, jfs is at 32 KiB and btrfs and reiserfs
+    are at 64 KiB
+*/
+static bool probeSuperblock(const QByteArray &device, KDiskInfo &disk) {
+    const int fd = ::open(device.constData(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd == -1) {
+        return false;
+    }
+
+    uchar buffer[4096];
+    bool result = false;
+    if (readSuperblock(fd, 0, buffer, sizeof(buffer))) {
+        const uchar *ext = buffer + 1024;
+        const bool fat32 = (::memcmp(buffer + 82, "FAT32   ", 8) == 0);
+        if (superblock16(ext + 0x38) == 0xEF53 && !(superblock32(ext + 0x60) & 0x8)) {
+            // journal devices are not filesystems, ext2 and ext3 are told apart by features
+            const quint32 compat = superblock32(ext + 0x5C);
+            const quint32 incompat = superblock32(ext + 0x60);
+            const quint32 rocompat = superblock32(ext + 0x64);
+            if ((incompat & ~quint32(0x16)) || (rocompat & ~quint32(0x7))) {
+                disk.fstype = "ext4";
+            } else if (compat & 0x4) {
+                disk.fstype = "ext3";
+            } else {
+                disk.fstype = "ext2";
+            }
+            disk.fsuuid = superblockUuid(ext + 0x68);
+            disk.label = superblockLabel(ext + 0x78, 16);
+            result = true;
+        } else if (::memcmp(buffer, "XFSB", 4) == 0) {
+            disk.fstype = "xfs";
+            disk.fsuuid = superblockUuid(buffer + 32);
+            disk.label = superblockLabel(buffer + 108, 12);
+            result = true;
+        } else if (::memcmp(buffer + 3, "NTFS    ", 8) == 0) {
+            // the label is in the $Volume file, udev reports it once it has probed the device
+            disk.fstype = "ntfs";
+            disk.fsuuid = QByteArray::number(quint64(superblock32(buffer + 0x48))
+                | (quint64(superblock32(buffer + 0x4C)) << 32), 16).rightJustified(16, '0').toUpper();
+            result = true;
+        } else if (buffer[510] == 0x55 && buffer[511] == 0xAA
+            && (fat32 || ::memcmp(buffer + 54, "FAT1", 4) == 0)) {
+            // the extended boot record of FAT32 is further than the one of FAT12 and FAT16
+            const uchar *record = fat32 ? buffer + 67 : buffer + 39;
+            disk.fstype = "vfat";
+            disk.fsuuid = QByteArray::number(superblock16(record + 2), 16).rightJustified(4, '0').toUpper()
+                + '-' + QByteArray::number(superblock16(record), 16).rightJustified(4, '0').toUpper();
+            disk.label = superblockLabel(record + 4, 11);
+            if (disk.label == "NO NAME") {
+                disk.label.clear();
+            }
+            result = true;
+        }
+    }
+
+    if (!result && readSuperblock(fd, 32768, buffer, 512) && ::memcmp(buffer, "JFS1", 4) == 0) {
+        disk.fstype = "jfs";
+        disk.fsuuid = superblockUuid(buffer + 136);
+        disk.label = superblockLabel(buffer + 152, 16);
+        result = true;
+    }
+
+    if (!result && readSuperblock(fd, 65536, buffer, sizeof(buffer))) {
+        if (::memcmp(buffer + 0x40, "_BHRfS_M", 8) == 0) {
+            disk.fstype = "btrfs";
+            disk.fsuuid = superblockUuid(buffer + 0x20);
+            disk.label = superblockLabel(buffer + 0x12B, 256);
+            result = true;
+        } else if (::memcmp(buffer + 52, "ReIsEr2Fs", 9) == 0 || ::memcmp(buffer + 52, "ReIsEr3Fs", 9) == 0) {
+            // the UUID and the label are only in the 3.6 format, there is nothing to probe in 3.5
+            disk.fstype = "reiserfs";
+            disk.fsuuid = superblockUuid(buffer + 84);
+            disk.label = superblockLabel(buffer + 100, 16);
+            result = true;
+        }
+    }
+
+    ::close(fd);
+    disk.fstype = internFilesystem(disk.fstype);
+    return (result && !disk.fsuuid.isEmpty());
+}
+
+static bool s_clientmode = false;
+static bool s_probing = false;
+static int s_quietwindow = 50;
+static int s_receivebuffer = 0;
+static QString s_snapshot;
+static QString s_eventsource;
+static QString s_metricsfile;
+static const quint32 s_snapshotmagic = 0x4B424C4B;
+static const quint32 s_snapshotversion = 2;
+
+typedef QPair<KDiskInfo, QByteArray> KDiskEntry;
+
+// reads the disk information from device, optionally the parent disk name too
+static KDiskInfo deviceInfo(udev_device *dev, QByteArray *parent) {
+    KDiskInfo result;
+    result.name = udev_device_get_property_value(dev, "DEVNAME");
+    result.label = udev_device_get_property_value(dev, "ID_FS_LABEL");
+    result.fstype = internFilesystem(udev_device_get_property_value(dev, "ID_FS_TYPE"));
+    result.fsuuid = udev_device_get_property_value(dev, "ID_FS_UUID");
+    const char *devtype = udev_device_get_property_value(dev, "DEVTYPE");
+    if (qstrcmp(devtype, "disk") == 0) {
+        result.type = KDiskInfo::KDiskType::Disk;
+    } else if (qstrcmp(devtype, "partition") == 0) {
+        result.type = KDiskInfo::KDiskType::Partition;
+    }
+    // ID_PART_ENTRY_SIZE overflows the size past 2 TiB and is not set for whole disks
+    readTopology(result);
+    if (parent) {
+        // the parent is owned by the device, it must not be unreferenced
+        udev_device *parentdev = udev_device_get_parent_with_subsystem_devtype(dev, "block", "disk");
+        if (parentdev) {
+            *parent = udev_device_get_property_value(parentdev, "DEVNAME");
+        }
+    }
+    return result;
+}
+
+typedef QHash<QByteArray, QByteArray> KDiskProperties;
+
+// reads the disk information from recorded event properties, the parent is looked up in sysfs
+static KDiskInfo propertiesInfo(const KDiskProperties &properties, QByteArray *parent) {
+    KDiskInfo result;
+    result.name = properties.value("DEVNAME");
+    result.label = properties.value("ID_FS_LABEL");
+    result.fstype = internFilesystem(properties.value("ID_FS_TYPE"));
+    result.fsuuid = properties.value("ID_FS_UUID");
+    const QByteArray devtype = properties.value("DEVTYPE");
+    if (devtype == "disk") {
+        result.type = KDiskInfo::KDiskType::Disk;
+    } else if (devtype == "partition") {
+        result.type = KDiskInfo::KDiskType::Partition;
+    }
+    readTopology(result);
+    if (parent) {
+        const QString whole = diskParent(result.name);
+        if (!whole.isEmpty()) {
+            *parent = "/dev/" + whole.toUtf8();
+        }
+    }
+    return result;
+}
+
+// event from the udev monitor or from a recorded event stream, both are processed the same way
+class KDiskEvent {
+
+    public:
+        KDiskEvent(udev_device *dev);
+        KDiskEvent(const KDiskProperties &properties);
+
+        const char* action() const;
+        const char* property(const char *name) const;
+        KDiskInfo info(QByteArray *parent) const;
+
+    private:
+        udev_device *m_dev;
+        KDiskProperties m_properties;
+};
+
+KDiskEvent::KDiskEvent(udev_device *dev)
+    : m_dev(dev) {
+}
+
+KDiskEvent::KDiskEvent(const KDiskProperties &properties)
+    : m_dev(Q_NULLPTR),
+    m_properties(properties) {
+}
+
+const char* KDiskEvent::action() const {
+    if (m_dev) {
+        return udev_device_get_action(m_dev);
+    }
+    return property("ACTION");
+}
+
+const char* KDiskEvent::property(const char *name) const {
+    if (m_dev) {
+        return udev_device_get_property_value(m_dev, name);
+    }
+    const KDiskProperties::const_iterator it = m_properties.constFind(name);
+    if (it == m_properties.constEnd()) {
+        return Q_NULLPTR;
+    }
+    return it.value().constData();
+}
+
+KDiskInfo KDiskEvent::info(QByteArray *parent) const {
+    if (m_dev) {
+        return deviceInfo(m_dev, parent);
+    }
+    return propertiesInfo(m_properties, parent);
+}
+
+// single pass over the udev database, devices without filesystem UUID are skipped by udev
+static QList<KDiskEntry> enumerateDisks(udev *context) {
+    QList<KDiskEntry> result;
+
+    udev_enumerate *enumerate = udev_enumerate_new(context);
+    if (!enumerate) {
+        qWarning() << "could not create udev enumerator";
+        return result;
+    }
+    udev_enumerate_add_match_subsystem(enumerate, "block");
+    udev_enumerate_add_match_property(enumerate, "ID_FS_UUID", "*");
+    udev_enumerate_scan_devices(enumerate);
+
+    udev_list_entry *entry = Q_NULLPTR;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+        udev_device *dev = udev_device_new_from_syspath(context, udev_list_entry_get_name(entry));
+        if (!dev) {
+            continue;
+        }
+        QByteArray parent;
+        const KDiskInfo info = deviceInfo(dev, &parent);
+        if (!info.isNull()) {
+            result.append(qMakePair(info, parent));
+        }
+        udev_device_unref(dev);
+    }
+
+    udev_enumerate_unref(enumerate);
+    return result;
+}
+
+static bool sameDisk(const KDiskInfo &disk, const KDiskInfo &other) {
+    return (disk.name == other.name && disk.label == other.label && disk.fstype == other.fstype
+        && disk.fsuuid == other.fsuuid && disk.size == other.size && disk.type == other.type
+        && disk.bytes == other.bytes && disk.logicalblocksize == other.logicalblocksize
+        && disk.physicalblocksize == other.physicalblocksize && disk.minimumio == other.minimumio
+        && disk.optimalio == other.optimalio && disk.alignmentoffset == other.alignmentoffset
+        && disk.rotational == other.rotational);
+}
+
+// verifies the tracked disks without blocking, e.g. after startup from snapshot
+class KDiskScanner : public QThread {
+    Q_OBJECT
+
+    public:
+        KDiskScanner(QObject *parent);
+
+        QList<KDiskEntry> entries() const;
+
+    protected:
+        // reimplementation
+        void run();
+
+    private:
+        QList<KDiskEntry> m_entries;
+};
+
+KDiskScanner::KDiskScanner(QObject *parent)
+    : QThread(parent) {
+}
+
+QList<KDiskEntry> KDiskScanner::entries() const {
+    return m_entries;
+}
+
+void KDiskScanner::run() {
+    // udev contexts are not thread-safe, the scanner uses its own
+    udev *context = udev_new();
+    if (context) {
+        m_entries = enumerateDisks(context);
+        udev_unref(context);
+    }
+}
+
+// device name and mount point of mounted disk
+typedef QPair<QByteArray, QByteArray> KDiskMount;
+
+static bool readUsage(const KDiskMount &mount, KDiskUsage *usage) {
+    struct statvfs statinfo;
+    if (::statvfs(mount.second.constData(), &statinfo) != 0) {
+        qWarning() << "cannot get usage of" << mount.second << qt_error_string(errno);
+        return false;
+    }
+
+    usage->name = mount.first;
+    usage->mountpoint = mount.second;
+    usage->timestamp = QDateTime::currentMSecsSinceEpoch();
+    const qint64 fragment = statinfo.f_frsize ? statinfo.f_frsize : statinfo.f_bsize;
+    usage->size = qint64(statinfo.f_blocks) * fragment;
+    usage->used = qint64(statinfo.f_blocks - statinfo.f_bfree) * fragment;
+    usage->available = qint64(statinfo.f_bavail) * fragment;
+    usage->files = statinfo.f_files;
+    usage->freefiles = statinfo.f_ffree;
+    return true;
+}
+
+// calls statvfs() for the mounted disks, a hung filesystem blocks only this thread
+class KDiskUsageCollector : public QThread {
+    Q_OBJECT
+
+    public:
+        KDiskUsageCollector(const QList<KDiskMount> &mounts, QObject *parent);
+
+        QList<KDiskUsage> usage() const;
+
+    protected:
+        // reimplementation
+        void run();
+
+    private:
+        const QList<KDiskMount> m_mounts;
+        QList<KDiskUsage> m_usage;
+};
+
+KDiskUsageCollector::KDiskUsageCollector(const QList<KDiskMount> &mounts, QObject *parent)
+    : QThread(parent),
+    m_mounts(mounts) {
+}
+
+QList<KDiskUsage> KDiskUsageCollector::usage() const {
+    return m_usage;
+}
+
+void KDiskUsageCollector::run() {
+    foreach (const KDiskMount &mount, m_mounts) {
+        KDiskUsage usage;
+        if (readUsage(mount, &usage)) {
+            m_usage.append(usage);
+        }
+    }
+}
+
+// FITRIM takes as long as the device needs to discard the range, it runs off the event loop
+class KDiskTrimmer : public QThread {
+    Q_OBJECT
+
+    public:
+        KDiskTrimmer(const QByteArray &directory, const quint64 start, const quint64 length, QObject *parent);
+
+        quint64 length() const;
+        qint64 trimmed() const;
+
+    protected:
+        // reimplementation
+        void run();
+
+    private:
+        const QByteArray m_directory;
+        const quint64 m_start;
+        const quint64 m_length;
+        qint64 m_trimmed;
+};
+
+KDiskTrimmer::KDiskTrimmer(const QByteArray &directory, const quint64 start, const quint64 length, QObject *parent)
+    : QThread(parent),
+    m_directory(directory),
+    m_start(start),
+    m_length(length),
+    m_trimmed(-1) {
+}
+
+quint64 KDiskTrimmer::length() const {
+    return m_length;
+}
+
+qint64 KDiskTrimmer::trimmed() const {
+    return m_trimmed;
+}
+
+void KDiskTrimmer::run() {
+    m_trimmed = trimRange(m_directory, m_start, m_length);
+}
+
+/*
+    samples /sys/class/block/<disk>/stat of the tracked disks, the files are kept open and re-read
+    with pread() so that sampling does not walk sysfs
+*/
+class KDiskSampler {
+
+    public:
+        KDiskSampler();
+        ~KDiskSampler();
+
+        void sample(const QList<KDiskInfo> &disks);
+        QList<KDiskStats> stats() const;
+        QList<KDiskStats> history(const QByteArray &disk) const;
+
+    private:
+        // read I/Os, read sectors, write I/Os, write sectors, I/O ticks and time in queue
+        struct KDiskCounters {
+            quint64 reads;
+            quint64 readsectors;
+            quint64 writes;
+            quint64 writesectors;
+            quint64 ioticks;
+            quint64 queueticks;
+        };
+        struct KDiskTrack {
+            int fd;
+            qint64 time;
+            KDiskCounters counters;
+            QVector<KDiskStats> ring;
+            int next;
+            int count;
+        };
+
+        static const int s_ringsize = 60;
+
+        static bool readCounters(const int fd, KDiskCounters *counters);
+
+        QElapsedTimer m_clock;
+        QHash<QByteArray, KDiskTrack> m_tracks;
+};
+
+KDiskSampler::KDiskSampler() {
+    m_clock.start();
+}
+
+KDiskSampler::~KDiskSampler() {
+    foreach (const KDiskTrack &track, m_tracks) {
+        ::close(track.fd);
+    }
+}
+
+bool KDiskSampler::readCounters(const int fd, KDiskCounters *counters) {
+    char buffer[256];
+    const ssize_t count = ::pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (count < 1) {
+        return false;
+    }
+    buffer[count] = '\0';
+
+    // see Documentation/block/stat.rst in the kernel tree for the fields
+    quint64 fields[11];
+    char *it = buffer;
+    for (int i = 0; i < 11; i++) {
+        char *end = Q_NULLPTR;
+        fields[i] = ::strtoull(it, &end, 10);
+        if (end == it) {
+            return false;
+        }
+        it = end;
+    }
+
+    counters->reads = fields[0];
+    counters->readsectors = fields[2];
+    counters->writes = fields[4];
+    counters->writesectors = fields[6];
+    counters->ioticks = fields[9];
+    counters->queueticks = fields[10];
+    return true;
+}
+
+// counters may wrap on 32-bit kernels, treat that as no activity
+static inline double counterDelta(const quint64 current, const quint64 previous) {
+    return current >= previous ? double(current - previous) : 0.0;
+}
+
+void KDiskSampler::sample(const QList<KDiskInfo> &disks) {
+    const qint64 now = m_clock.elapsed();
+    const qint64 timestamp = QDateTime::currentMSecsSinceEpoch();
+
+    QSet<QByteArray> tracked;
+    foreach (const KDiskInfo &disk, disks) {
+        tracked.insert(disk.name);
+        if (m_tracks.contains(disk.name)) {
+            continue;
+        }
+
+        const QByteArray path = QFile::encodeName(s_systemroot + "/sys/class/block/"
+            + QFileInfo(disk.name).fileName() + "/stat");
+        KDiskTrack track;
+        track.fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+        if (track.fd == -1) {
+            qWarning() << "cannot open" << path << qt_error_string(errno);
+            continue;
+        }
+        track.time = now;
+        if (!readCounters(track.fd, &track.counters)) {
+            qWarning() << "cannot read" << path;
+            ::close(track.fd);
+            continue;
+        }
+        track.ring.resize(s_ringsize);
+        track.next = 0;
+        track.count = 0;
+        m_tracks.insert(disk.name, track);
+    }
+
+    QHash<QByteArray, KDiskTrack>::iterator it = m_tracks.begin();
+    while (it != m_tracks.end()) {
+        KDiskTrack &track = it.value();
+        if (!tracked.contains(it.key())) {
+            ::close(track.fd);
+            it = m_tracks.erase(it);
+            continue;
+        }
+
+        const double interval = double(now - track.time);
+        KDiskCounters counters;
+        if (interval <= 0.0 || !readCounters(track.fd, &counters)) {
+            ++it;
+            continue;
+        }
+
+        KDiskStats &stats = track.ring[track.next];
+        stats.name = it.key();
+        stats.timestamp = timestamp;
+        stats.readiops = counterDelta(counters.reads, track.counters.reads) * 1000.0 / interval;
+        stats.writeiops = counterDelta(counters.writes, track.counters.writes) * 1000.0 / interval;
+        // sectors in the stat file are always 512 bytes
+        stats.readbytes = counterDelta(counters.readsectors, track.counters.readsectors) * 512000.0 / interval;
+        stats.writebytes = counterDelta(counters.writesectors, track.counters.writesectors) * 512000.0 / interval;
+        stats.queuedepth = counterDelta(counters.queueticks, track.counters.queueticks) / interval;
+        stats.utilization = qMin(counterDelta(counters.ioticks, track.counters.ioticks) * 100.0 / interval, 100.0);
+
+        track.next = (track.next + 1) % s_ringsize;
+        track.count = qMin(track.count + 1, int(s_ringsize));
+        track.time = now;
+        track.counters = counters;
+        ++it;
+    }
+}
+
+QList<KDiskStats> KDiskSampler::stats() const {
+    QList<KDiskStats> result;
+    foreach (const KDiskTrack &track, m_tracks) {
+        if (track.count > 0) {
+            result.append(track.ring.at((track.next + s_ringsize - 1) % s_ringsize));
+        }
+    }
+    return result;
+}
+
+QList<KDiskStats> KDiskSampler::history(const QByteArray &disk) const {
+    QList<KDiskStats> result;
+    const KDiskTrack track = m_tracks.value(disk);
+    for (int i = track.count; i > 0; i--) {
+        result.append(track.ring.at((track.next + s_ringsize - i) % s_ringsize));
+    }
+    return result;
+}
+
+class KDiskManagerPrivate : public QObject {
+    Q_OBJECT
+
+    public:
+        KDiskManagerPrivate(QObject *parent = Q_NULLPTR);
+        ~KDiskManagerPrivate();
+
+        QList<KDiskInfo> disks();
+        KDiskInfo find(const QByteArray &uuid) const;
+        QList<KDiskInfo> children(const QByteArray &disk) const;
+        QByteArray parent(const QByteArray &disk) const;
+
+        KDiskInfo info(const QString &disk, QByteArray *parent = Q_NULLPTR);
+        void probe(KDiskInfo &disk, const bool read);
+        QList<KDiskInfo> infoAll(const QStringList &disks);
+        bool call(const QString &method, const QStringList &arguments);
+        QMap<QString, bool> callAll(const QString &method, const QList<KDiskInfo> &disks);
+        QDBusPendingReply<bool> asyncCall(const QString &method, const QStringList &arguments);
+
+        QByteArray mountpoint(const QByteArray &disk);
+        QByteArray device(const QByteArray &mountpoint);
+
+        QList<KDiskQueueRule> m_queuerules;
+        void applyQueueRules(const QString &disk);
+
+        // mount() reads the profiles from the worker threads of the daemon
+        QReadWriteLock m_mountprofileslock;
+        QHash<QString, QMap<QString, QString> > m_mountprofiles;
+
+        void setTrimSchedule(const int interval, const qint64 chunk, const int pause);
+        QTimer *m_trimtimer;
+
+        QTimer *m_metricstimer;
+
+        KDiskSampler m_sampler;
+        QTimer *m_statstimer;
+
+        QList<KDiskMount> mounts();
+        QTimer *m_usagetimer;
+        KDiskUsageCollector *m_usagecollector;
+        QList<KDiskUsage> m_usage;
+        QList<int> m_usagethresholds;
+        // highest threshold reached by every mounted disk
+        QHash<QByteArray, int> m_usagelevels;
+
+        QMap<QString, int> capabilities();
+
+    public Q_SLOTS:
+        void collectUsage();
+
+    Q_SIGNALS:
+        void addedDisk(const KDiskInfo &disk);
+        void changedDisk(const KDiskInfo &disk);
+        void removedDisk(const KDiskInfo &disk);
+        void mountsChanged();
+        void usageThreshold(const KDiskUsage &usage, const int threshold);
+
+    private Q_SLOTS:
+        void monitorActivated();
+        void replayActivated();
+        void mountsActivated();
+        void pathActivated();
+        void daemonAdded(const KDiskInfoV2 &disk, const QString &parent, uint generation, const QString &epoch);
+        void daemonChanged(const KDiskInfoV2 &disk, const QString &parent, uint generation, const QString &epoch);
+        void daemonRemoved(const KDiskInfo &disk, uint generation, const QString &epoch);
+        void daemonOwnerChanged(const QString &name, const QString &oldowner, const QString &newowner);
+        void scannerFinished();
+        void saveSnapshot();
+        void flushChanges();
+        void sampleStats();
+        void usageCollected();
+        void startTrim();
+        void trimChunk();
+        void trimFinished();
+        void writeMetrics();
+
+    private:
+        void setupMonitor();
+        void setupClient();
+        void setupReplay();
+        void processEvent(const KDiskEvent &event, const QElapsedTimer &latency);
+        void processReplayLine(const QByteArray &line);
+        void synchronize();
+        bool acceptGeneration(const uint generation, const QString &epoch);
+        bool loadSnapshot();
+        void scheduleChange(const QByteArray &name);
+        void resynchronize();
+
+        void insertDisk(const KDiskInfo &info, const QByteArray &parent);
+        KDiskInfo takeDisk(const QByteArray &name);
+        void updateMounts(const bool force);
+        void setupPathWatch();
+
+        udev *m_udev;
+        udev_monitor *m_monitor;
+        QSocketNotifier *m_notifier;
+        // last generation of the daemon applied to the registry in client mode
+        uint m_generation;
+        // instance of the daemon the generation belongs to
+        QString m_epoch;
+
+        // the registry is keyed by device name, other indexes refer to it by name
+        QHash<QByteArray, KDiskInfo> m_disks;
+        QHash<QByteArray, QByteArray> m_uuids;
+        QHash<QByteArray, QByteArray> m_parents;
+        QMultiHash<QByteArray, QByteArray> m_children;
+        QList<KDiskInfo> m_diskslist;
+        bool m_disksdirty;
+        // filesystems read from the superblocks, until the device changes
+        QHash<QByteArray, KDiskInfo> m_probes;
+
+        // change events are coalesced per disk until it is quiet for a while
+        struct KDiskChange {
+            qint64 since;
+            qint64 deadline;
+            int events;
+        };
+        QElapsedTimer m_clock;
+        QHash<QByteArray, KDiskChange> m_changes;
+        QTimer *m_changetimer;
+
+        // volumes are trimmed one at a time, chunk by chunk with a pause in between
+        QTimer *m_trimchunktimer;
+        qint64 m_trimchunk;
+        QList<KDiskInfo> m_trimqueue;
+        QByteArray m_trimdirectory;
+        quint64 m_trimoffset;
+        quint64 m_trimsize;
+        KDiskTrimmer *m_trimmer;
+
+        KDiskScanner *m_scanner;
+        bool m_rescanpending;
+        // disks that had events while the scanner was running, their state is newer
+        QSet<QByteArray> m_touched;
+        QTimer *m_snapshottimer;
+
+        // recorded events replayed instead of the udev monitor, keyed by device name
+        int m_replayfd;
+        QSocketNotifier *m_replaynotifier;
+        QByteArray m_replaybuffer;
+        KDiskProperties m_replayevent;
+        QHash<QByteArray, KDiskProperties> m_replaydevices;
+
+        int m_mountsfd;
+        // the pending state is per open file, the event loop consumes it on the notifier one
+        int m_mountsqueryfd;
+        QSocketNotifier *m_mountsnotifier;
+        // the mount index is queried from the worker threads of the daemon too
+        QMutex m_mountsmutex;
+        QHash<QByteArray, QByteArray> m_mountpoints;
+        QHash<QByteArray, QByteArray> m_mountdevices;
+
+        // the capabilities are refreshed only when something changes in the PATH directories
+        QMap<QString, int> m_capabilities;
+        bool m_capabilitiesdirty;
+        int m_pathfd;
+        QSocketNotifier *m_pathnotifier;
+};
+Q_GLOBAL_STATIC(KDiskManagerPrivate, diskManager);
+
+KDiskManagerPrivate::KDiskManagerPrivate(QObject *parent)
+    : QObject(parent),
+    m_trimtimer(Q_NULLPTR),
+    m_metricstimer(Q_NULLPTR),
+    m_statstimer(Q_NULLPTR),
+    m_usagetimer(Q_NULLPTR),
+    m_usagecollector(Q_NULLPTR),
+    m_udev(Q_NULLPTR),
+    m_monitor(Q_NULLPTR),
+    m_notifier(Q_NULLPTR),
+    m_generation(0),
+    m_disksdirty(true),
+    m_changetimer(Q_NULLPTR),
+    m_trimchunktimer(Q_NULLPTR),
+    m_trimchunk(0),
+    m_trimoffset(0),
+    m_trimsize(0),
+    m_trimmer(Q_NULLPTR),
+    m_scanner(Q_NULLPTR),
+    m_rescanpending(false),
+    m_snapshottimer(Q_NULLPTR),
+    m_replayfd(-1),
+    m_replaynotifier(Q_NULLPTR),
+    m_mountsfd(-1),
+    m_mountsqueryfd(-1),
+    m_mountsnotifier(Q_NULLPTR),
+    m_capabilitiesdirty(true),
+    m_pathfd(-1),
+    m_pathnotifier(Q_NULLPTR) {
+    qRegisterMetaType<KDiskInfo>();
+    qRegisterMetaType<QList<KDiskInfo> >();
+    qDBusRegisterMetaType<KDiskInfo>();
+    qDBusRegisterMetaType<QList<KDiskInfo> >();
+    qRegisterMetaType<KDiskInfoV2>();
+    qRegisterMetaType<QList<KDiskInfoV2> >();
+    qDBusRegisterMetaType<KDiskInfoV2>();
+    qDBusRegisterMetaType<QList<KDiskInfoV2> >();
+    qRegisterMetaType<KDiskStats>();
+    qRegisterMetaType<QList<KDiskStats> >();
+    qDBusRegisterMetaType<KDiskStats>();
+    qDBusRegisterMetaType<QList<KDiskStats> >();
+    qRegisterMetaType<KDiskUsage>();
+    qRegisterMetaType<QList<KDiskUsage> >();
+    qDBusRegisterMetaType<KDiskUsage>();
+    qDBusRegisterMetaType<QList<KDiskUsage> >();
+
+    m_statstimer = new QTimer(this);
+    connect(m_statstimer, SIGNAL(timeout()), this, SLOT(sampleStats()));
+
+    m_usagetimer = new QTimer(this);
+    connect(m_usagetimer, SIGNAL(timeout()), this, SLOT(collectUsage()));
+
+    m_mountprofiles = defaultMountProfiles();
+
+    m_trimtimer = new QTimer(this);
+    connect(m_trimtimer, SIGNAL(timeout()), this, SLOT(startTrim()));
+    m_trimchunktimer = new QTimer(this);
+    m_trimchunktimer->setSingleShot(true);
+    connect(m_trimchunktimer, SIGNAL(timeout()), this, SLOT(trimChunk()));
+
+    m_metricstimer = new QTimer(this);
+    connect(m_metricstimer, SIGNAL(timeout()), this, SLOT(writeMetrics()));
+
+    if (!QDBusConnection::systemBus().isConnected()) {
+        qWarning() << "Cannot connect to the D-Bus system bus";
+    }
+
+    if (s_clientmode) {
+        setupClient();
+    } else if (!s_eventsource.isEmpty()) {
+        setupReplay();
+    } else {
+        setupMonitor();
+    }
+
+    // the mount table is readable with POLLPRI whenever something is mounted or unmounted
+    const QByteArray mountinfo = QFile::encodeName(s_systemroot + "/proc/self/mountinfo");
+    m_mountsfd = ::open(mountinfo.constData(), O_RDONLY | O_CLOEXEC);
+    if (m_mountsfd != -1) {
+        m_mountsqueryfd = ::open(mountinfo.constData(), O_RDONLY | O_CLOEXEC);
+        updateMounts(true);
+        m_mountsnotifier = new QSocketNotifier(m_mountsfd, QSocketNotifier::Exception, this);
+        connect(m_mountsnotifier, SIGNAL(activated(int)), this, SLOT(mountsActivated()));
+    } else {
+        qWarning() << "cannot open /proc/self/mountinfo" << qt_error_string(errno);
+    }
+
+    setupPathWatch();
+}
+
+KDiskManagerPrivate::~KDiskManagerPrivate() {
+    if (m_notifier) {
+        m_notifier->setEnabled(false);
+    }
+
+    if (m_scanner) {
+        m_scanner->wait();
+    }
+    if (m_usagecollector) {
+        m_usagecollector->wait();
+    }
+    if (m_trimmer) {
+        m_trimmer->wait();
+    }
+    if (m_snapshottimer && m_snapshottimer->isActive()) {
+        saveSnapshot();
+    }
+
+    if (m_replaynotifier) {
+        m_replaynotifier->setEnabled(false);
+    }
+    if (m_replayfd != -1) {
+        ::close(m_replayfd);
+    }
+
+    if (m_mountsnotifier) {
+        m_mountsnotifier->setEnabled(false);
+    }
+    if (m_mountsfd != -1) {
+        ::close(m_mountsfd);
+    }
+    if (m_mountsqueryfd != -1) {
+        ::close(m_mountsqueryfd);
+    }
+
+    if (m_pathnotifier) {
+        m_pathnotifier->setEnabled(false);
+    }
+    if (m_pathfd != -1) {
+        ::close(m_pathfd);
+    }
+
+    udev_unref(m_udev);
+    udev_monitor_unref(m_monitor);
+}
+
+void KDiskManagerPrivate::setupPathWatch() {
+    m_pathfd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_pathfd == -1) {
+        qWarning() << "could not watch PATH directories" << qt_error_string(errno);
+        return;
+    }
+
+    const QStringList directories = QFile::decodeName(qgetenv("PATH")).split(':', QString::SkipEmptyParts);
+    foreach (const QString &directory, directories) {
+        // missing directories may be created later but that is rare enough to ignore
+        ::inotify_add_watch(m_pathfd, QFile::encodeName(directory).constData(),
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+            | IN_DELETE_SELF | IN_MOVE_SELF);
+    }
+
+    m_pathnotifier = new QSocketNotifier(m_pathfd, QSocketNotifier::Read, this);
+    connect(m_pathnotifier, SIGNAL(activated(int)), this, SLOT(pathActivated()));
+}
+
+void KDiskManagerPrivate::pathActivated() {
+    // the events themselves do not matter, any change invalidates the capabilities
+    char buffer[4096];
+    while (::read(m_pathfd, buffer, sizeof(buffer)) > 0) {
+    }
+    m_capabilitiesdirty = true;
+}
+
+QMap<QString, int> KDiskManagerPrivate::capabilities() {
+    if (m_capabilitiesdirty) {
+        m_capabilities = filesystemCapabilities();
+        // without the watch there is nothing to invalidate the cache
+        m_capabilitiesdirty = (m_pathfd == -1);
+    }
+    return m_capabilities;
+}
+
+void KDiskManagerPrivate::setupMonitor() {
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    m_udev = udev_new();
+    if (m_udev) {
+        // receiving is enabled before the scan so that no event is lost in between
+        m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+
+        if (m_monitor) {
+            udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "block", Q_NULLPTR);
+            if (s_receivebuffer > 0
+                && udev_monitor_set_receive_buffer_size(m_monitor, s_receivebuffer) < 0) {
+                qWarning() << "could not set disk monitor buffer size to" << s_receivebuffer;
+            }
+            udev_monitor_enable_receiving(m_monitor);
+        }
+
+        if (!s_snapshot.isEmpty()) {
+            m_snapshottimer = new QTimer(this);
+            m_snapshottimer->setSingleShot(true);
+            m_snapshottimer->setInterval(5000);
+            connect(m_snapshottimer, SIGNAL(timeout()), this, SLOT(saveSnapshot()));
+        }
+
+        if (!s_snapshot.isEmpty() && loadSnapshot()) {
+            qDebug() << "loaded" << m_disks.size() << "disks from snapshot in"
+                << elapsed.elapsed() << "ms";
+
+            m_scanner = new KDiskScanner(this);
+            connect(m_scanner, SIGNAL(finished()), this, SLOT(scannerFinished()));
+            m_scanner->start();
+        } else {
+            foreach (const KDiskEntry &entry, enumerateDisks(m_udev)) {
+                insertDisk(entry.first, entry.second);
+            }
+            qDebug() << "enumerated" << m_disks.size() << "disks in" << elapsed.elapsed() << "ms";
+        }
+    }
+
+    m_clock.start();
+    m_changetimer = new QTimer(this);
+    m_changetimer->setSingleShot(true);
+    connect(m_changetimer, SIGNAL(timeout()), this, SLOT(flushChanges()));
+
+    if (!m_udev || !m_monitor) {
+        qWarning() << "could not setup disk monitor";
+    } else {
+        // the monitor socket is non-blocking, events are processed as soon as they arrive
+        m_notifier = new QSocketNotifier(udev_monitor_get_fd(m_monitor), QSocketNotifier::Read, this);
+        connect(m_notifier, SIGNAL(activated(int)), this, SLOT(monitorActivated()));
+    }
+}
+
+bool KDiskManagerPrivate::loadSnapshot() {
+    QFile file(s_snapshot);
+    if (!file.open(QFile::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    quint32 magic = 0;
+    quint32 version = 0;
+    quint32 count = 0;
+    stream >> magic >> version >> count;
+    if (magic != s_snapshotmagic || version != s_snapshotversion) {
+        qWarning() << "ignoring incompatible snapshot" << s_snapshot;
+        return false;
+    }
+
+    for (quint32 i = 0; i < count; i++) {
+        KDiskInfo disk;
+        QByteArray parent;
+        qint32 size = 0;
+        qint32 type = 0;
+        qint32 logicalblocksize = 0;
+        qint32 physicalblocksize = 0;
+        qint32 minimumio = 0;
+        qint32 optimalio = 0;
+        qint32 alignmentoffset = 0;
+        stream >> disk.name >> disk.label >> disk.fstype >> disk.fsuuid >> size >> type >> parent
+            >> disk.bytes >> logicalblocksize >> physicalblocksize >> minimumio >> optimalio
+            >> alignmentoffset >> disk.rotational;
+        disk.fstype = internFilesystem(disk.fstype);
+        disk.size = size;
+        disk.type = KDiskInfo::KDiskType(type);
+        disk.logicalblocksize = logicalblocksize;
+        disk.physicalblocksize = physicalblocksize;
+        disk.minimumio = minimumio;
+        disk.optimalio = optimalio;
+        disk.alignmentoffset = alignmentoffset;
+        if (stream.status() != QDataStream::Ok || disk.isNull()) {
+            qWarning() << "ignoring corrupted snapshot" << s_snapshot;
+            m_disks.clear();
+            m_uuids.clear();
+            m_parents.clear();
+            m_children.clear();
+            m_disksdirty = true;
+            return false;
+        }
+        insertDisk(disk, parent);
+    }
+
+    return true;
+}
+
+void KDiskManagerPrivate::saveSnapshot() {
+    if (s_snapshot.isEmpty() || m_scanner) {
+        return;
+    }
+
+    const QFileInfo snapshotinfo(s_snapshot);
+    if (!QDir().mkpath(snapshotinfo.path())) {
+        qWarning() << "could not create snapshot directory" << snapshotinfo.path();
+        return;
+    }
+
+    // written to temporary file first so that the snapshot is never half-written
+    const QString temporary = s_snapshot + ".tmp";
+    QFile file(temporary);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qWarning() << "could not open snapshot" << temporary;
+        return;
+    }
+
+    QDataStream stream(&file);
+    stream << s_snapshotmagic << s_snapshotversion << quint32(m_disks.size());
+    foreach (const KDiskInfo &disk, m_disks) {
+        stream << disk.name << disk.label << disk.fstype << disk.fsuuid << qint32(disk.size)
+            << qint32(disk.type) << m_parents.value(disk.name) << disk.bytes
+            << qint32(disk.logicalblocksize) << qint32(disk.physicalblocksize)
+            << qint32(disk.minimumio) << qint32(disk.optimalio) << qint32(disk.alignmentoffset)
+            << disk.rotational;
+    }
+    file.close();
+
+    if (::rename(QFile::encodeName(temporary).constData(), QFile::encodeName(s_snapshot).constData()) != 0) {
+        qWarning() << "could not write snapshot" << s_snapshot << qt_error_string(errno);
+    }
+}
+
+void KDiskManagerPrivate::scannerFinished() {
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    // only the differences between the snapshot and the actual state are signaled
+    QSet<QByteArray> present;
+    foreach (const KDiskEntry &entry, m_scanner->entries()) {
+        const KDiskInfo &disk = entry.first;
+        present.insert(disk.name);
+        if (m_touched.contains(disk.name)) {
+            continue;
+        }
+        if (!m_disks.contains(disk.name)) {
+            insertDisk(disk, entry.second);
+            emit addedDisk(disk);
+        } else if (!sameDisk(m_disks.value(disk.name), disk)) {
+            insertDisk(disk, entry.second);
+            emit changedDisk(disk);
+        }
+    }
+    foreach (const KDiskInfo &disk, m_disks) {
+        if (!present.contains(disk.name) && !m_touched.contains(disk.name)) {
+            emit removedDisk(takeDisk(disk.name));
+        }
+    }
+
+    m_scanner->deleteLater();
+    m_scanner = Q_NULLPTR;
+    m_touched.clear();
+    saveSnapshot();
+
+    qDebug() << "synchronized with udev in" << elapsed.elapsed() << "ms";
+
+    if (m_rescanpending) {
+        m_rescanpending = false;
+        resynchronize();
+    }
+}
+
+void KDiskManagerPrivate::resynchronize() {
+    if (m_scanner) {
+        // events may have been lost after the running scanner read the device
+        m_rescanpending = true;
+        return;
+    }
+
+    s_resyncs.add();
+    m_scanner = new KDiskScanner(this);
+    connect(m_scanner, SIGNAL(finished()), this, SLOT(scannerFinished()));
+    m_scanner->start();
+}
+
+void KDiskManagerPrivate::setupClient() {
+    /*
+        the daemon already tracks the disks, instead of scanning sysfs and listening to udev
+        mirror the daemon registry and keep it current from the daemon signals. The version 2
+        signals carry the topology and the parent so that nothing is read from sysfs
+    */
+    QDBusConnection connection = QDBusConnection::systemBus();
+    connection.connect("com.kblockd.Block", "/com/kblockd/Block", "com.kblockd.Block",
+        "diskAddedV2", this, SLOT(daemonAdded(KDiskInfoV2,QString,uint,QString)));
+    connection.connect("com.kblockd.Block", "/com/kblockd/Block", "com.kblockd.Block",
+        "diskChangedV2", this, SLOT(daemonChanged(KDiskInfoV2,QString,uint,QString)));
+    connection.connect("com.kblockd.Block", "/com/kblockd/Block", "com.kblockd.Block",
+        "diskRemoved", this, SLOT(daemonRemoved(KDiskInfo,uint,QString)));
+    // a restarted daemon may not change anything for a long time, do not wait for its signals
+    connection.connect("org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+        "NameOwnerChanged", this, SLOT(daemonOwnerChanged(QString,QString,QString)));
+
+    synchronize();
+}
+
+void KDiskManagerPrivate::synchronize() {
+    QDBusMessage message = QDBusMessage::createMethodCall("com.kblockd.Block",
+        "/com/kblockd/Block", "com.kblockd.Block", "changesV2");
+    message << m_generation << m_epoch;
+    const QDBusMessage reply = QDBusConnection::systemBus().call(message);
+    if (reply.type() != QDBusMessage::ReplyMessage || reply.arguments().size() != 5) {
+        qWarning() << "cannot synchronize with the daemon" << reply.errorMessage();
+        return;
+    }
+
+    const uint generation = reply.arguments().at(0).toUInt();
+    const QList<KDiskInfoV2> changed = qdbus_cast<QList<KDiskInfoV2> >(reply.arguments().at(1));
+    const QStringList parents = reply.arguments().at(2).toStringList();
+    const QStringList removed = reply.arguments().at(3).toStringList();
+    const QString epoch = reply.arguments().at(4).toString();
+
+    if (epoch != m_epoch) {
+        // another daemon instance, the reply is its full registry
+        QSet<QByteArray> current;
+        foreach (const KDiskInfoV2 &disk, changed) {
+            current.insert(disk.info.name);
+        }
+        foreach (const KDiskInfo &disk, m_disks) {
+            if (!current.contains(disk.name)) {
+                emit removedDisk(takeDisk(disk.name));
+            }
+        }
+    }
+    m_generation = generation;
+    m_epoch = epoch;
+
+    foreach (const QString &name, removed) {
+        const KDiskInfo disk = takeDisk(name.toUtf8());
+        if (!disk.name.isEmpty()) {
+            emit removedDisk(disk);
+        }
+    }
+    for (int i = 0; i < changed.size(); i++) {
+        const KDiskInfo &disk = changed.at(i).info;
+        const bool known = m_disks.contains(disk.name);
+        insertDisk(disk, parents.value(i).toUtf8());
+        if (known) {
+            emit changedDisk(disk);
+        } else {
+            emit addedDisk(disk);
+        }
+    }
+}
+
+void KDiskManagerPrivate::daemonAdded(const KDiskInfoV2 &disk, const QString &parent, uint generation, const QString &epoch) {
+    if (!acceptGeneration(generation, epoch)) {
+        return;
+    }
+    m_generation = generation;
+
+    insertDisk(disk.info, parent.toUtf8());
+    emit addedDisk(disk.info);
+}
+
+void KDiskManagerPrivate::daemonChanged(const KDiskInfoV2 &disk, const QString &parent, uint generation, const QString &epoch) {
+    if (!acceptGeneration(generation, epoch)) {
+        return;
+    }
+    m_generation = generation;
+
+    insertDisk(disk.info, parent.toUtf8());
+    emit changedDisk(disk.info);
+}
+
+void KDiskManagerPrivate::daemonRemoved(const KDiskInfo &disk, uint generation, const QString &epoch) {
+    if (!acceptGeneration(generation, epoch)) {
+        return;
+    }
+    m_generation = generation;
+
+    const KDiskInfo info = takeDisk(disk.name);
+    if (!info.name.isEmpty()) {
+        emit removedDisk(info);
+    }
+}
+
+bool KDiskManagerPrivate::acceptGeneration(const uint generation, const QString &epoch) {
+    if (epoch == m_epoch && generation <= m_generation) {
+        // queued behind the reply of a synchronization that already covered it
+        return false;
+    }
+    if (epoch != m_epoch || generation != m_generation + 1) {
+        // missed a signal or the daemon was restarted
+        synchronize();
+        return false;
+    }
+    return true;
+}
+
+void KDiskManagerPrivate::daemonOwnerChanged(const QString &name, const QString &oldowner, const QString &newowner) {
+    Q_UNUSED(oldowner);
+    if (name != QLatin1String("com.kblockd.Block") || newowner.isEmpty()) {
+        return;
+    }
+    // new daemon instance, its generations say nothing about the registry
+    m_generation = 0;
+    m_epoch.clear();
+    synchronize();
+}
+
+QList<KDiskInfo> KDiskManagerPrivate::disks() {
+    // the list is shared with the callers and rebuilt only after the registry changes
+    if (m_disksdirty) {
+        m_diskslist = m_disks.values();
+        m_disksdirty = false;
+    }
+    return m_diskslist;
+}
+
+KDiskInfo KDiskManagerPrivate::find(const QByteArray &uuid) const {
+    return m_disks.value(m_uuids.value(uuid));
+}
+
+QList<KDiskInfo> KDiskManagerPrivate::children(const QByteArray &disk) const {
+    QList<KDiskInfo> result;
+    foreach (const QByteArray &child, m_children.values(disk)) {
+        result.append(m_disks.value(child));
+    }
+    return result;
+}
+
+QByteArray KDiskManagerPrivate::parent(const QByteArray &disk) const {
+    return m_parents.value(disk);
+}
+
+void KDiskManagerPrivate::insertDisk(const KDiskInfo &info, const QByteArray &parent) {
+    // drop the stale indexes first, the UUID and parent may differ after change
+    takeDisk(info.name);
+
+    m_disks.insert(info.name, info);
+    m_uuids.insert(info.fsuuid, info.name);
+    if (!parent.isEmpty()) {
+        m_parents.insert(info.name, parent);
+        m_children.insert(parent, info.name);
+    }
+    m_disksdirty = true;
+    s_disksgauge.set(m_disks.size());
+    if (m_snapshottimer && !m_snapshottimer->isActive()) {
+        m_snapshottimer->start();
+    }
+}
+
+KDiskInfo KDiskManagerPrivate::takeDisk(const QByteArray &name) {
+    const KDiskInfo result = m_disks.take(name);
+    if (result.name.isEmpty()) {
+        return result;
+    }
+
+    // multiple devices may carry the same UUID (e.g. multipath), only drop our own entry
+    if (m_uuids.value(result.fsuuid) == name) {
+        m_uuids.remove(result.fsuuid);
+    }
+    const QByteArray parent = m_parents.take(name);
+    if (!parent.isEmpty()) {
+        m_children.remove(parent, name);
+    }
+    m_disksdirty = true;
+    s_disksgauge.set(m_disks.size());
+    if (m_snapshottimer && !m_snapshottimer->isActive()) {
+        m_snapshottimer->start();
+    }
+    return result;
+}
+
+KDiskInfo KDiskManagerPrivate::info(const QString &disk, QByteArray *parent) {
+    KDiskInfo result;
+
+    if (s_clientmode) {
+        const QByteArray name = "/dev/" + QFileInfo(disk).fileName().toUtf8();
+        if (m_disks.contains(name)) {
+            return m_disks.value(name);
+        }
+
+        // untracked disks are not valid but the daemon may still know something about them
+        QDBusMessage message = QDBusMessage::createMethodCall("com.kblockd.Block",
+            "/com/kblockd/Block", "com.kblockd.Block", "info");
+        message << disk;
+        const QDBusMessage reply = QDBusConnection::systemBus().call(message);
+        if (reply.type() == QDBusMessage::ReplyMessage && reply.arguments().size() == 1) {
+            result = qdbus_cast<KDiskInfo>(reply.arguments().at(0));
+        } else {
+            qWarning() << "cannot get info for device from the daemon" << reply.errorMessage();
+        }
+        return result;
+    }
+
+    if (!s_eventsource.isEmpty()) {
+        const QByteArray name = "/dev/" + QFileInfo(disk).fileName().toUtf8();
+        const QHash<QByteArray, KDiskProperties>::const_iterator it = m_replaydevices.constFind(name);
+        if (it == m_replaydevices.constEnd()) {
+            qWarning() << "cannot get info for device because it was not replayed" << disk;
+            return result;
+        }
+        return propertiesInfo(it.value(), parent);
+    }
+
+    if (!m_udev) {
+        qWarning() << "cannot get info for device because no udev";
+        return result;
+    }
+
+    const QFileInfo devinfo = QFileInfo(disk);
+    const QByteArray path = "/sys/class/block/" + devinfo.fileName().toUtf8();
+
+    udev_device *dev = udev_device_new_from_syspath(m_udev, path);
+    if (dev) {
+        result = deviceInfo(dev, parent);
+    } else {
+        qWarning() << "cannot get info for device because no dev for" << disk;
+    }
+
+    udev_device_unref(dev);
+
+    // the change timer calls this too, reading devices would stall the event loop
+    probe(result, false);
+    return result;
+}
+
+void KDiskManagerPrivate::probe(KDiskInfo &disk, const bool read) {
+    /*
+        recorded events do not describe the devices present, there is nothing to read for them.
+        Events already carry what udev probed, only explicit queries read the superblock and
+        the rest uses what was read before. The daemon probes on behalf of the clients
+    */
+    if (!s_probing || s_clientmode || !s_eventsource.isEmpty() || disk.name.isEmpty()
+        || (!disk.fstype.isEmpty() && !disk.fsuuid.isEmpty())) {
+        return;
+    }
+    // partitioned disks have no filesystem of their own
+    if (m_children.contains(disk.name)) {
+        return;
+    }
+
+    KDiskInfo probed;
+    const QHash<QByteArray, KDiskInfo>::const_iterator it = m_probes.constFind(disk.name);
+    if (it != m_probes.constEnd()) {
+        probed = it.value();
+    } else if (read && probeSuperblock(disk.name, probed)) {
+        // failures are not cached, the device may be formatted any moment
+        m_probes.insert(disk.name, probed);
+    } else {
+        return;
+    }
+
+    // udev is right once it has probed the device itself
+    if (!disk.fstype.isEmpty() && disk.fstype != probed.fstype) {
+        return;
+    }
+    disk.fstype = probed.fstype;
+    if (disk.fsuuid.isEmpty()) {
+        disk.fsuuid = probed.fsuuid;
+    }
+    if (disk.label.isEmpty()) {
+        disk.label = probed.label;
+    }
+}
+
+QList<KDiskInfo> KDiskManagerPrivate::infoAll(const QStringList &disks) {
+    QList<KDiskInfo> result;
+    if (!s_clientmode) {
+        foreach (const QString &disk, disks) {
+            KDiskInfo diskinfo = info(disk);
+            probe(diskinfo, true);
+            result.append(diskinfo);
+        }
+        return result;
+    }
+
+    // tracked disks are mirrored, the rest is asked for in a single round trip
+    QStringList untracked;
+    foreach (const QString &disk, disks) {
+        const QByteArray name = "/dev/" + QFileInfo(disk).fileName().toUtf8();
+        if (!m_disks.contains(name)) {
+            untracked.append(disk);
+        }
+    }
+
+    QList<KDiskInfo> fetched;
+    if (!untracked.isEmpty()) {
+        QDBusMessage message = QDBusMessage::createMethodCall("com.kblockd.Block",
+            "/com/kblockd/Block", "com.kblockd.Block", "infoMany");
+        message << untracked;
+        const QDBusReply<QList<KDiskInfo> > reply = QDBusConnection::systemBus().call(message);
+        if (reply.isValid()) {
+            fetched = reply.value();
+        } else {
+            qWarning() << "cannot get info for devices from the daemon" << reply.error().message();
+        }
+    }
+
+    int index = 0;
+    foreach (const QString &disk, disks) {
+        const QByteArray name = "/dev/" + QFileInfo(disk).fileName().toUtf8();
+        if (m_disks.contains(name)) {
+            result.append(m_disks.value(name));
+        } else {
+            result.append(fetched.value(index));
+            index++;
+        }
+    }
+    return result;
+}
+
+bool KDiskManagerPrivate::call(const QString &method, const QStringList &arguments) {
+    QDBusMessage message = QDBusMessage::createMethodCall("com.kblockd.Block",
+        "/com/kblockd/Block", "com.kblockd.Block", method);
+    foreach (const QString &argument, arguments) {
+        message << argument;
+    }
+    const QDBusReply<bool> reply = QDBusConnection::systemBus().call(message);
+    if (reply.isValid()) {
+        return reply.value();
+    }
+    qWarning() << reply.error().message();
+    return false;
+}
+
+QMap<QString, bool> KDiskManagerPrivate::callAll(const QString &method, const QList<KDiskInfo> &disks) {
+    QStringList names;
+    foreach (const KDiskInfo &disk, disks) {
+        names.append(disk.name);
+    }
+
+    QDBusMessage message = QDBusMessage::createMethodCall("com.kblockd.Block",
+        "/com/kblockd/Block", "com.kblockd.Block", method);
+    message << names;
+    const QDBusReply<QVariantMap> reply = QDBusConnection::systemBus().call(message);
+    if (!reply.isValid()) {
+        qWarning() << reply.error().message();
+    }
+
+    // disks missing from the reply failed
+    QMap<QString, bool> result;
+    const QVariantMap results = reply.value();
+    foreach (const QString &name, names) {
+        result.insert(name, results.value(name).toBool());
+    }
+    return result;
+}
+
+QDBusPendingReply<bool> KDiskManagerPrivate::asyncCall(const QString &method, const QStringList &arguments) {
+    QDBusMessage message = QDBusMessage::createMethodCall("com.kblockd.Block",
+        "/com/kblockd/Block", "com.kblockd.Block", method);
+    foreach (const QString &argument, arguments) {
+        message << argument;
+    }
+    return QDBusConnection::systemBus().asyncCall(message);
+}
+
+QByteArray KDiskManagerPrivate::mountpoint(const QByteArray &disk) {
+    updateMounts(false);
+    QMutexLocker locker(&m_mountsmutex);
+    return m_mountpoints.value(disk);
+}
+
+QByteArray KDiskManagerPrivate::device(const QByteArray &mountpoint) {
+    updateMounts(false);
+    QMutexLocker locker(&m_mountsmutex);
+    return m_mountdevices.value(mountpoint);
+}
+
+// spaces, tabs, newlines and backslashes are escaped as octal sequences in mountinfo
+static QByteArray unescapeMountField(const QByteArray &field) {
+    if (!field.contains('\\')) {
+        return field;
+    }
+
+    QByteArray result;
+    result.reserve(field.size());
+    for (int i = 0; i < field.size(); i++) {
+        if (field.at(i) == '\\' && i + 3 < field.size()) {
+            bool ok = false;
+            const char octal = char(field.mid(i + 1, 3).toInt(&ok, 8));
+            if (ok) {
+                result.append(octal);
+                i += 3;
+                continue;
+            }
+        }
+        result.append(field.at(i));
+    }
+    return result;
+}
+
+void KDiskManagerPrivate::updateMounts(const bool force) {
+    if (m_mountsfd == -1) {
+        return;
+    }
+
+    // the descriptor offset is shared, only one thread may rewind and read it at a time
+    QMutexLocker locker(&m_mountsmutex);
+
+    if (!force && m_mountsqueryfd != -1) {
+        /*
+            the notifier may not have had the chance to run yet, e.g. when checking right after
+            mount() from the same event loop iteration. polling clears the pending state of the
+            descriptor polled so the query one is used, the event loop polls the notifier one
+        */
+        struct pollfd pfd;
+        pfd.fd = m_mountsqueryfd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, 0) < 1 || !(pfd.revents & (POLLPRI | POLLERR))) {
+            return;
+        }
+    }
+
+    if (::lseek(m_mountsfd, 0, SEEK_SET) == -1) {
+        qWarning() << "cannot rewind /proc/self/mountinfo" << qt_error_string(errno);
+        return;
+    }
+
+    QByteArray content;
+    char buffer[4096];
+    while (true) {
+        const ssize_t count = ::read(m_mountsfd, buffer, sizeof(buffer));
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == -1) {
+            qWarning() << "cannot read /proc/self/mountinfo" << qt_error_string(errno);
+            return;
+        } else if (count == 0) {
+            break;
+        }
+        content.append(buffer, count);
+    }
+
+    QHash<QByteArray, QByteArray> mountpoints;
+    QHash<QByteArray, QByteArray> mountdevices;
+    foreach (const QByteArray &line, content.split('\n')) {
+        /*
+            36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+            the number of optional fields varies, the source follows the separator and fstype
+        */
+        const QList<QByteArray> fields = line.split(' ');
+        const int separator = fields.indexOf("-", 6);
+        if (fields.size() < 5 || separator < 0 || separator + 2 >= fields.size()) {
+            continue;
+        }
+        const QByteArray source = unescapeMountField(fields.at(separator + 2));
+        const QByteArray target = unescapeMountField(fields.at(4));
+        // later entries shadow earlier ones, same as the kernel does
+        mountpoints.insert(source, target);
+        mountdevices.insert(target, source);
+    }
+
+    if (mountpoints != m_mountpoints || mountdevices != m_mountdevices) {
+        m_mountpoints = mountpoints;
+        m_mountdevices = mountdevices;
+        s_mountsgauge.set(m_mountpoints.size());
+        locker.unlock();
+        emit mountsChanged();
+    }
+}
+
+QList<KDiskMount> KDiskManagerPrivate::mounts() {
+    updateMounts(false);
+    QMutexLocker locker(&m_mountsmutex);
+    QList<KDiskMount> result;
+    QHash<QByteArray, KDiskInfo>::const_iterator it = m_disks.constBegin();
+    while (it != m_disks.constEnd()) {
+        const QByteArray mountpoint = m_mountpoints.value(it.key());
+        if (!mountpoint.isEmpty()) {
+            result.append(KDiskMount(it.key(), mountpoint));
+        }
+        ++it;
+    }
+    return result;
+}
+
+void KDiskManagerPrivate::collectUsage() {
+    // collection slower than the interval is not stacked up
+    if (m_usagecollector) {
+        return;
+    }
+    m_usagecollector = new KDiskUsageCollector(mounts(), this);
+    connect(m_usagecollector, SIGNAL(finished()), this, SLOT(usageCollected()));
+    m_usagecollector->start();
+}
+
+void KDiskManagerPrivate::usageCollected() {
+    m_usage = m_usagecollector->usage();
+    m_usagecollector->deleteLater();
+    m_usagecollector = Q_NULLPTR;
+
+    // unmounted disks are forgotten, they start from no threshold once mounted again
+    QHash<QByteArray, int> levels;
+    foreach (const KDiskUsage &usage, m_usage) {
+        const int percent = usage.percent();
+        int level = 0;
+        foreach (const int threshold, m_usagethresholds) {
+            if (percent >= threshold && threshold > level) {
+                level = threshold;
+            }
+        }
+        levels.insert(usage.name, level);
+        if (level != m_usagelevels.value(usage.name, 0)) {
+            qDebug() << usage.mountpoint << "is" << percent << "% full";
+            emit usageThreshold(usage, level);
+        }
+    }
+    m_usagelevels = levels;
+}
+
+void KDiskManagerPrivate::mountsActivated() {
+    // the event loop poll already consumed the pending state, re-read unconditionally
+    updateMounts(true);
+}
+
+void KDiskManagerPrivate::monitorActivated() {
+    // latency is measured from the moment the event is readable to the moment it is signaled
+    QElapsedTimer latency;
+    latency.start();
+
+    errno = 0;
+    udev_device *dev = udev_monitor_receive_device(m_monitor);
+    while (dev) {
+        processEvent(KDiskEvent(dev), latency);
+        udev_device_unref(dev);
+        errno = 0;
+        dev = udev_monitor_receive_device(m_monitor);
+    }
+
+    // the socket buffer overflowed, events were lost and the registry may be out of date
+    if (errno == ENOBUFS) {
+        qWarning() << "disk monitor buffer overflow, resynchronizing";
+        resynchronize();
+    }
+}
+
+void KDiskManagerPrivate::processEvent(const KDiskEvent &event, const QElapsedTimer &latency) {
+    KDiskMetricTimer timer(s_eventseconds);
+    const char* name = event.property("DEVNAME");
+    const char* action = event.action();
+    s_receivedevents.add();
+    if (m_scanner) {
+        m_touched.insert(name);
+    }
+
+    // whatever was read from the superblock is stale once the device changes
+    m_probes.remove(name);
+
+    // the event carries all properties of the device, no need to query udev again
+    if (qstrcmp(action, "add") == 0) {
+        m_changes.remove(name);
+        // disks are tuned even if not valid, e.g. when partitioned but not formatted
+        if (!m_queuerules.isEmpty() && qstrcmp(event.property("DEVTYPE"), "disk") == 0) {
+            applyQueueRules(name);
+        }
+        QByteArray parent;
+        const KDiskInfo info = event.info(&parent);
+        if (!info.isNull()) {
+            insertDisk(info, parent);
+            s_emittedevents.add();
+            emit addedDisk(info);
+            qDebug() << "added" << name << "in" << (latency.nsecsElapsed() / 1000) << "us";
+        }
+    } else if (qstrcmp(action, "change") == 0) {
+        if (s_quietwindow > 0) {
+            scheduleChange(name);
+        } else {
+            QByteArray parent;
+            const KDiskInfo info = event.info(&parent);
+            if (!info.isNull()) {
+                insertDisk(info, parent);
+                s_emittedevents.add();
+                emit changedDisk(info);
+                qDebug() << "changed" << name << "in" << (latency.nsecsElapsed() / 1000) << "us";
+            }
+        }
+    } else if (qstrcmp(action, "remove") == 0) {
+        m_changes.remove(name);
+        /*
+            reusing disk info from already tracked disks since info cannot be obtained once
+            the device is gone
+        */
+        const KDiskInfo info = takeDisk(name);
+        if (!info.name.isEmpty()) {
+            s_emittedevents.add();
+            emit removedDisk(info);
+            qDebug() << "removed" << name << "in" << (latency.nsecsElapsed() / 1000) << "us";
+        }
+    } else if (qstrcmp(action, "bind") != 0 && qstrcmp(action, "unbind") != 0) {
+        // bind/unbind are driver changing for device type of event
+        qWarning() << "unknown action" << action;
+    }
+}
+
+void KDiskManagerPrivate::setupReplay() {
+    /*
+        events are read from a file in the format of "udevadm monitor --property", a pipe is
+        followed for as long as the manager lives while regular file is replayed at once
+    */
+    m_clock.start();
+    m_changetimer = new QTimer(this);
+    m_changetimer->setSingleShot(true);
+    connect(m_changetimer, SIGNAL(timeout()), this, SLOT(flushChanges()));
+
+    const QByteArray path = QFile::encodeName(s_eventsource);
+    struct stat statinfo;
+    const bool pipe = (::stat(path.constData(), &statinfo) == 0 && S_ISFIFO(statinfo.st_mode));
+    // the pipe is opened for writing too so that it does not report end of file without writer
+    m_replayfd = ::open(path.constData(), (pipe ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+    if (m_replayfd == -1) {
+        qWarning() << "could not open event source" << s_eventsource << qt_error_string(errno);
+        return;
+    }
+
+    replayActivated();
+    if (pipe) {
+        m_replaynotifier = new QSocketNotifier(m_replayfd, QSocketNotifier::Read, this);
+        connect(m_replaynotifier, SIGNAL(activated(int)), this, SLOT(replayActivated()));
+    } else {
+        ::close(m_replayfd);
+        m_replayfd = -1;
+    }
+    qDebug() << "replayed" << m_disks.size() << "disks from" << s_eventsource;
+}
+
+void KDiskManagerPrivate::replayActivated() {
+    char buffer[4096];
+    bool endoffile = false;
+    while (true) {
+        const ssize_t count = ::read(m_replayfd, buffer, sizeof(buffer));
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == 0) {
+            endoffile = true;
+            break;
+        } else if (count < 0) {
+            break;
+        }
+        m_replaybuffer.append(buffer, count);
+
+        // lines are processed as they are read so that the buffer stays small
+        int start = 0;
+        int end = m_replaybuffer.indexOf('\n');
+        while (end != -1) {
+            processReplayLine(m_replaybuffer.mid(start, end - start));
+            start = end + 1;
+            end = m_replaybuffer.indexOf('\n', start);
+        }
+        m_replaybuffer.remove(0, start);
+    }
+
+    // the last event of a file does not have to be terminated by empty line
+    if (endoffile) {
+        if (!m_replaybuffer.isEmpty()) {
+            processReplayLine(m_replaybuffer);
+            m_replaybuffer.clear();
+        }
+        processReplayLine(QByteArray());
+    }
+}
+
+void KDiskManagerPrivate::processReplayLine(const QByteArray &line) {
+    const QByteArray trimmed = line.trimmed();
+    if (!trimmed.isEmpty()) {
+        // header lines, e.g. "UDEV [123.456] add /devices/... (block)", carry nothing extra
+        const int separator = trimmed.indexOf('=');
+        if (separator > 0) {
+            m_replayevent.insert(trimmed.left(separator), trimmed.mid(separator + 1));
+        }
+        return;
+    }
+
+    if (m_replayevent.isEmpty()) {
+        return;
+    }
+    KDiskProperties properties;
+    qSwap(properties, m_replayevent);
+    if (properties.contains("SUBSYSTEM") && properties.value("SUBSYSTEM") != "block") {
+        return;
+    }
+
+    // kernel events name the device without the directory
+    QByteArray &name = properties["DEVNAME"];
+    if (name.isEmpty()) {
+        return;
+    } else if (!name.startsWith('/')) {
+        name.prepend("/dev/");
+    }
+
+    const QByteArray action = properties.value("ACTION");
+    if (action == "remove") {
+        m_replaydevices.remove(name);
+    } else {
+        m_replaydevices.insert(name, properties);
+    }
+
+    QElapsedTimer latency;
+    latency.start();
+    processEvent(KDiskEvent(properties), latency);
+}
+
+void KDiskManagerPrivate::applyQueueRules(const QString &disk) {
+    const QString directory = queueDirectory(disk);
+    const QString name = QFileInfo(directory).fileName();
+    foreach (const KDiskQueueRule &rule, m_queuerules) {
+        bool matches = true;
+        for (int i = 0; i < rule.criteria.size() && matches; i++) {
+            const QPair<QString, QString> &criterion = rule.criteria.at(i);
+            if (criterion.first == "name") {
+                const QRegExp pattern(criterion.second, Qt::CaseSensitive, QRegExp::Wildcard);
+                matches = pattern.exactMatch(name);
+            } else if (criterion.first == "rotational") {
+                matches = (readSysfs(directory + "/queue/rotational") == criterion.second);
+            } else if (criterion.first == "removable") {
+                matches = (readSysfs(directory + "/removable") == criterion.second);
             }
+        }
+        if (!matches) {
+            continue;
+        }
+
+        // later rules override earlier ones
+        for (int i = 0; i < rule.settings.size(); i++) {
+            const QPair<QString, QString> &setting = rule.settings.at(i);
+            qDebug() << "tuning" << name << setting.first << "to" << setting.second;
+            KDiskManager::setQueueParameter(name, setting.first, setting.second);
+        }
+    }
+}
+
+void KDiskManagerPrivate::setTrimSchedule(const int interval, const qint64 chunk, const int pause) {
+    m_trimchunk = chunk;
+    m_trimchunktimer->setInterval(pause);
+    if (interval > 0) {
+        m_trimtimer->start(interval);
+    } else {
+        m_trimtimer->stop();
+        m_trimchunktimer->stop();
+        m_trimqueue.clear();
+        m_trimdirectory.clear();
+    }
+}
+
+void KDiskManagerPrivate::startTrim() {
+    if (m_trimmer || !m_trimqueue.isEmpty() || !m_trimdirectory.isEmpty()) {
+        qWarning() << "previous trim is still running";
+        return;
+    }
+
+    foreach (const KDiskInfo &disk, disks()) {
+        if (discardSupported(disk.name) && !mountpoint(disk.name).isEmpty()) {
+            m_trimqueue.append(disk);
+        }
+    }
+    trimChunk();
+}
+
+void KDiskManagerPrivate::trimChunk() {
+    while (m_trimdirectory.isEmpty()) {
+        if (m_trimqueue.isEmpty()) {
+            return;
+        }
+
+        const KDiskInfo disk = m_trimqueue.takeFirst();
+        const QByteArray directory = mountpoint(disk.name);
+        struct statvfs statinfo;
+        if (directory.isEmpty() || ::statvfs(directory.constData(), &statinfo) != 0) {
+            continue;
+        }
+        qDebug() << "trimming" << disk.name << "mounted on" << directory;
+        m_trimdirectory = directory;
+        m_trimoffset = 0;
+        m_trimsize = quint64(statinfo.f_blocks) * statinfo.f_frsize;
+    }
+
+    quint64 length = (m_trimchunk > 0) ? quint64(m_trimchunk) : m_trimsize;
+    /*
+        the size from statvfs does not include the filesystem overhead, the last chunk reaches the
+        end of the range space like fstrim does and the kernel clamps it to the filesystem
+    */
+    if (length >= m_trimsize - m_trimoffset) {
+        length = Q_UINT64_C(0xFFFFFFFFFFFFFFFF) - m_trimoffset;
+    }
+    m_trimmer = new KDiskTrimmer(m_trimdirectory, m_trimoffset, length, this);
+    connect(m_trimmer, SIGNAL(finished()), this, SLOT(trimFinished()));
+    m_trimmer->start();
+}
+
+void KDiskManagerPrivate::trimFinished() {
+    const quint64 length = m_trimmer->length();
+    const qint64 trimmed = m_trimmer->trimmed();
+    m_trimmer->deleteLater();
+    m_trimmer = Q_NULLPTR;
+
+    // the schedule may have been disabled while the chunk was running
+    if (m_trimdirectory.isEmpty()) {
+        return;
+    }
+
+    if (trimmed < 0) {
+        m_trimoffset = m_trimsize;
+    } else {
+        m_trimoffset += length;
+    }
+    if (m_trimoffset >= m_trimsize) {
+        m_trimdirectory.clear();
+    }
+
+    if (!m_trimdirectory.isEmpty() || !m_trimqueue.isEmpty()) {
+        m_trimchunktimer->start();
+    }
+}
+
+void KDiskManagerPrivate::writeMetrics() {
+    if (s_metricsfile.isEmpty()) {
+        return;
+    }
+
+    // written to temporary file first so that the collector never reads half-written file
+    const QString temporary = s_metricsfile + ".tmp";
+    QFile file(temporary);
+    if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qWarning() << "could not open metrics file" << temporary;
+        return;
+    }
+    file.write(KDiskManager::metrics());
+    file.close();
+
+    if (::rename(QFile::encodeName(temporary).constData(), QFile::encodeName(s_metricsfile).constData()) != 0) {
+        qWarning() << "could not write metrics file" << s_metricsfile << qt_error_string(errno);
+    }
+}
+
+void KDiskManagerPrivate::sampleStats() {
+    m_sampler.sample(disks());
+}
+
+void KDiskManagerPrivate::scheduleChange(const QByteArray &name) {
+    const qint64 now = m_clock.elapsed();
+    KDiskChange &change = m_changes[name];
+    if (change.events == 0) {
+        change.since = now;
+    }
+    change.events++;
+    change.deadline = now + s_quietwindow;
+
+    // the timer is re-armed for the remaining disks when it fires
+    if (!m_changetimer->isActive()) {
+        m_changetimer->start(s_quietwindow);
+    }
+}
+
+void KDiskManagerPrivate::flushChanges() {
+    KDiskMetricTimer timer(s_flushseconds);
+    const qint64 now = m_clock.elapsed();
+    qint64 next = -1;
+    QList<QByteArray> due;
+    QHash<QByteArray, KDiskChange>::const_iterator it = m_changes.constBegin();
+    while (it != m_changes.constEnd()) {
+        if (it.value().deadline <= now) {
+            due.append(it.key());
+        } else if (next < 0 || it.value().deadline < next) {
+            next = it.value().deadline;
+        }
+        ++it;
+    }
+
+    // the state is queried once the disk is quiet, it is up-to-date with the last event
+    foreach (const QByteArray &name, due) {
+        const KDiskChange change = m_changes.take(name);
+        QByteArray parent;
+        const KDiskInfo info = KDiskManagerPrivate::info(name, &parent);
+        if (!info.isNull()) {
+            insertDisk(info, parent);
+            s_emittedevents.add();
+            emit changedDisk(info);
+            qDebug() << "changed" << name << "after" << change.events << "events in"
+                << (now - change.since) << "ms";
+        }
+    }
+
+    if (next >= 0) {
+        m_changetimer->start(next - now);
+    }
+}
+
+KDiskManager::KDiskManager(QObject *parent)
+    : QObject(parent) {
+    connect(diskManager(), SIGNAL(addedDisk(KDiskInfo)),
+        this, SLOT(emitAdded(KDiskInfo)));
+    connect(diskManager(), SIGNAL(changedDisk(KDiskInfo)),
+        this, SLOT(emitChanged(KDiskInfo)));
+    connect(diskManager(), SIGNAL(removedDisk(KDiskInfo)),
+        this, SLOT(emitRemoved(KDiskInfo)));
+    connect(diskManager(), SIGNAL(mountsChanged()),
+        this, SIGNAL(mountsChanged()));
+    connect(diskManager(), SIGNAL(usageThreshold(KDiskUsage,int)),
+        this, SIGNAL(usageThreshold(KDiskUsage,int)));
+}
+
+QStringList KDiskManager::supported() {
+    const QMap<QString, int> capabilities = diskManager()->capabilities();
+    QStringList result;
+    foreach (const QString &fstype, s_knownfstypes) {
+        const int fscapabilities = capabilities.value(fstype);
+        if ((fscapabilities & CanFsck) && (fscapabilities & CanMkfs)) {
+            result << fstype;
+        }
+    }
+    if (capabilities.value("swap") & CanMkfs) {
+        result << "swap";
+    }
+    return result;
+}
+
+QMap<QString, int> KDiskManager::capabilities() {
+    return diskManager()->capabilities();
+}
+
+QList<KDiskInfo> KDiskManager::disks() {
+    return diskManager()->disks();
+}
+
+KDiskInfo KDiskManager::find(const QString &uuid) {
+    return diskManager()->find(uuid.toUtf8());
+}
+
+QList<KDiskInfo> KDiskManager::children(const QString &disk) {
+    return diskManager()->children(disk.toUtf8());
+}
+
+QString KDiskManager::parent(const QString &disk) {
+    return QString::fromUtf8(diskManager()->parent(disk.toUtf8()));
+}
+
+KDiskInfo KDiskManager::info(const QString &disk) {
+    KDiskMetricTimer timer(s_infoseconds);
+    KDiskInfo result = diskManager()->info(disk);
+    diskManager()->probe(result, true);
+    return result;
+}
+
+QList<KDiskInfo> KDiskManager::infoAll(const QStringList &disks) {
+    return diskManager()->infoAll(disks);
+}
+
+bool KDiskManager::mounted(const QString &disk) {
+    return !mountpoint(disk).isEmpty();
+}
+
+QString KDiskManager::mountpoint(const QString &disk) {
+    KDiskMetricTimer timer(s_mountpointseconds);
+    return diskManager()->mountpoint(disk.toUtf8());
+}
+
+QString KDiskManager::device(const QString &mountpoint) {
+    return diskManager()->device(mountpoint.toUtf8());
+}
+
+bool KDiskManager::rescan() {
+    return execJob(rescanJob());
+}
+
+QMap<QString, bool> KDiskManager::rescan(const QList<KDiskInfo> &disks, const int concurrency) {
+    KDiskBatch batch(rescanDiskJob, disks, concurrency);
+    return batch.exec();
+}
+
+KDiskJob* KDiskManager::rescanJob() {
+    return rescanJob(disks());
+}
+
+KDiskJob* KDiskManager::rescanJob(const QList<KDiskInfo> &disks) {
+    qDebug() << "scanning for disk changes";
+
+    // partprobe is part of parted
+    const QString partprobe = QStandardPaths::findExecutable("partprobe");
+    // partx is part of util-linux
+    const QString partx = QStandardPaths::findExecutable("partx");
+    QList<QStringList> commands;
+    foreach (const KDiskInfo &disk, disks) {
+        if (disk.type == KDiskInfo::KDiskType::Partition) {
+            continue;
+        }
+        if (!partprobe.isEmpty()) {
+            commands << (QStringList() << partprobe << disk.name);
         } else if (!partx.isEmpty()) {
-            QProcess partxproc;
-            partxproc.start(partx, QStringList() << "-u" << disk.name);
-            partxproc.waitForFinished(-1);
-            if (partxproc.exitCode() != 0) {
-                qWarning() << partxproc.readAllStandardError();
-                return false;
-            }
+            commands << (QStringList() << partx << "-u" << disk.name);
         } else {
             const QFileInfo devinfo = QFileInfo(disk.name);
-            const QString rescanpath = "/sys/block/" + devinfo.fileName() + "/device/rescan";
+            const QString rescanpath = s_systemroot + "/sys/block/" + devinfo.fileName() + "/device/rescan";
             QFile rescanfile(rescanpath);
             if (rescanfile.open(QFile::WriteOnly)) {
                 rescanfile.write("1");
                 rescanfile.close();
             } else {
-                qWarning() << "could not open rescan file" << rescanpath;
-                return false;
+                KDiskJob *job = new KDiskJob(commands, "could not open rescan file " + rescanpath);
+                return instrumentJob(job, &s_rescanseconds, &s_rescanfailures);
             }
         }
     }
 
-    return true;
+    return instrumentJob(new KDiskJob(commands), &s_rescanseconds, &s_rescanfailures);
 }
 
 bool KDiskManager::fsck(const KDiskInfo &disk) {
+    return execJob(fsckJob(disk));
+}
+
+QMap<QString, bool> KDiskManager::fsckAll(const QList<KDiskInfo> &disks, const int concurrency) {
+    KDiskBatch batch(KDiskManager::fsckJob, disks, concurrency);
+    return batch.exec();
+}
+
+KDiskJob* KDiskManager::fsckJob(const KDiskInfo &disk) {
+    QList<QStringList> commands;
     if (disk.isNull()) {
-        qWarning() << "invalid disk" << disk;
-        return false;
+        return instrumentJob(new KDiskJob(commands, "invalid disk " + disk.name),
+            &s_fsckseconds, &s_fsckfailures);
     }
 
     if (mounted(disk.name)) {
-        qWarning() << "device is mounted" << disk;
-        return false;
+        return instrumentJob(new KDiskJob(commands, "device is mounted " + disk.name),
+            &s_fsckseconds, &s_fsckfailures);
     }
 
     qDebug() << "checking" << disk;
-    QProcess fsckproc;
-    fsckproc.start("fsck", QStringList() << "-p" << disk.name);
-    fsckproc.waitForStarted(-1);
-    while (fsckproc.state() == QProcess::Running) {
-        QCoreApplication::processEvents();
-    }
-    if (fsckproc.exitCode() != 0) {
-        qWarning() << fsckproc.readAllStandardError();
-        return false;
-    }
-
-    return true;
+    // progress is written to standard output, the descriptor of the job process
+    commands << (QStringList() << "fsck" << "-C" << "1" << "-p" << disk.name);
+    return instrumentJob(new KDiskJob(commands), &s_fsckseconds, &s_fsckfailures);
 }
 
-bool KDiskManager::mount(const KDiskInfo &disk, const QString &directory) {
+bool KDiskManager::mount(const KDiskInfo &disk, const QString &directory, const QString &options) {
     if (disk.isNull()) {
         qWarning() << "invalid disk" << disk;
         return false;
@@ -463,6 +3487,44 @@ bool KDiskManager::mount(const KDiskInfo &disk, const QString &directory) {
         return true;
     }
 
+    // profiles are expanded in place so that explicit options after them take precedence
+    QStringList expanded;
+    foreach (const QString &option, options.split(',', QString::SkipEmptyParts)) {
+        const QString trimmed = option.trimmed();
+        if (trimmed.startsWith("profile=")) {
+            const QString profile = trimmed.mid(8);
+            const QString profileoptions = mountProfile(disk.fstype, profile);
+            if (profileoptions.isEmpty()) {
+                qWarning() << "invalid mount profile" << profile << "for" << disk.fstype;
+                return false;
+            }
+            expanded << profileoptions.split(',', QString::SkipEmptyParts);
+        } else {
+            expanded << trimmed;
+        }
+    }
+
+    unsigned long flags = 0;
+    QStringList data;
+    foreach (const QString &option, expanded) {
+        const QByteArray name = option.toUtf8();
+        bool isflag = false;
+        for (int i = 0; s_mountflags[i].name; i++) {
+            if (name == s_mountflags[i].name) {
+                if (s_mountflags[i].set) {
+                    flags |= s_mountflags[i].flag;
+                } else {
+                    flags &= ~s_mountflags[i].flag;
+                }
+                isflag = true;
+                break;
+            }
+        }
+        if (!isflag) {
+            data << option;
+        }
+    }
+
     QByteArray mountdir = directory.toUtf8();
     if (mountdir.isEmpty()) {
         mountdir = "/mnt/" + disk.fsuuid;
@@ -474,9 +3536,13 @@ bool KDiskManager::mount(const KDiskInfo &disk, const QString &directory) {
         return false;
     }
 
-    qDebug() << "mounting" << disk << "to" << mountdir;
-    const int rv = ::mount(disk.name.constData(), mountdir.constData(), disk.fstype.constData(), 0, Q_NULLPTR);
+    const QByteArray mountdata = data.join(",").toUtf8();
+    qDebug() << "mounting" << disk << "to" << mountdir << "with" << expanded;
+    KDiskMetricTimer timer(s_mountseconds);
+    const int rv = ::mount(disk.name.constData(), mountdir.constData(), disk.fstype.constData(),
+        flags, mountdata.isEmpty() ? Q_NULLPTR : mountdata.constData());
     if (rv != 0) {
+        s_mountfailures.add();
         qWarning() << qt_error_string(errno);
         return false;
     }
@@ -484,6 +3550,129 @@ bool KDiskManager::mount(const KDiskInfo &disk, const QString &directory) {
     return true;
 }
 
+QMap<QString, bool> KDiskManager::mountAll(const QList<KDiskInfo> &disks, const QString &options, const int concurrency) {
+    return runMountTasks(disks, options, true, concurrency);
+}
+
+QMap<QString, bool> KDiskManager::unmountAll(const QList<KDiskInfo> &disks, const int concurrency) {
+    return runMountTasks(disks, QString(), false, concurrency);
+}
+
+// direct I/O to the file must be aligned to the logical block size of the device it is on
+static quint32 backingBlockSize(const int fd) {
+    struct stat statinfo;
+    if (::fstat(fd, &statinfo) != 0 || major(statinfo.st_dev) == 0) {
+        return 512;
+    }
+    const QString devicepath = s_systemroot + QString("/sys/dev/block/%1:%2")
+        .arg(major(statinfo.st_dev)).arg(minor(statinfo.st_dev));
+    const QString name = QFileInfo(QFileInfo(devicepath).canonicalFilePath()).fileName();
+    const quint32 result = readSysfs(queueDirectory(name) + "/queue/logical_block_size").toUInt();
+    // loop devices take powers of two from 512 to the page size
+    if (result < 512 || result > 4096 || (result & (result - 1)) != 0) {
+        return 512;
+    }
+    return result;
+}
+
+QString KDiskManager::mountImage(const QString &path, const QString &options) {
+    const bool readonly = options.split(',', QString::SkipEmptyParts).contains("ro");
+    const int mode = (readonly ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+    const QByteArray imagepath = QFile::encodeName(path);
+    const int imagefd = ::open(imagepath.constData(), mode);
+    if (imagefd == -1) {
+        qWarning() << "could not open image" << path << qt_error_string(errno);
+        return QString();
+    }
+    const int controlfd = ::open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (controlfd == -1) {
+        qWarning() << "could not open /dev/loop-control" << qt_error_string(errno);
+        ::close(imagefd);
+        return QString();
+    }
+
+    KLoopConfig config;
+    ::memset(&config, 0, sizeof(config));
+    config.fd = imagefd;
+    config.blocksize = backingBlockSize(imagefd);
+    // the loop device is detached by the kernel once the filesystem is unmounted
+    config.info.flags = LO_FLAGS_DIRECT_IO | LO_FLAGS_AUTOCLEAR;
+    if (readonly) {
+        config.info.flags |= LO_FLAGS_READ_ONLY;
+    }
+    ::strncpy(reinterpret_cast<char*>(config.info.filename), imagepath.constData(),
+        sizeof(config.info.filename) - 1);
+
+    // another process may take the free loop device first, it is retried a few times then
+    QByteArray device;
+    int loopfd = -1;
+    int error = 0;
+    for (int i = 0; i < 3 && loopfd == -1; i++) {
+        const int number = ::ioctl(controlfd, LOOP_CTL_GET_FREE);
+        if (number < 0) {
+            error = errno;
+            break;
+        }
+        device = "/dev/loop" + QByteArray::number(number);
+        loopfd = ::open(device.constData(), mode);
+        if (loopfd == -1) {
+            error = errno;
+            break;
+        }
+        if (::ioctl(loopfd, LOOP_CONFIGURE, &config) != 0) {
+            error = errno;
+            ::close(loopfd);
+            loopfd = -1;
+            if (error != EBUSY) {
+                break;
+            }
+        }
+    }
+    // the loop device holds its own reference to the image
+    ::close(controlfd);
+    ::close(imagefd);
+    if (loopfd == -1) {
+        qWarning() << "could not set up loop device for" << path << qt_error_string(error);
+        return QString();
+    }
+
+    // udev is not asked, it has not seen the device yet and it is not thread-safe
+    KDiskInfo disk;
+    disk.name = device;
+    disk.type = KDiskInfo::KDiskType::Disk;
+    readTopology(disk);
+    if (!probeSuperblock(device, disk)) {
+        qWarning() << "no known filesystem in image" << path;
+    } else if (mount(disk, QString(), options)) {
+        // the mount keeps the loop device busy, closing it does not detach it
+        ::close(loopfd);
+        return QString::fromLatin1(device);
+    }
+
+    ::ioctl(loopfd, LOOP_CLR_FD);
+    ::close(loopfd);
+    return QString();
+}
+
+QStringList KDiskManager::mountProfiles(const QString &fstype) {
+    QReadLocker locker(&diskManager()->m_mountprofileslock);
+    return diskManager()->m_mountprofiles.value(fstype).keys();
+}
+
+QString KDiskManager::mountProfile(const QString &fstype, const QString &profile) {
+    QReadLocker locker(&diskManager()->m_mountprofileslock);
+    return diskManager()->m_mountprofiles.value(fstype).value(profile);
+}
+
+void KDiskManager::setMountProfile(const QString &fstype, const QString &profile, const QString &options) {
+    QWriteLocker locker(&diskManager()->m_mountprofileslock);
+    if (options.isEmpty()) {
+        diskManager()->m_mountprofiles[fstype].remove(profile);
+    } else {
+        diskManager()->m_mountprofiles[fstype].insert(profile, options);
+    }
+}
+
 bool KDiskManager::unmount(const KDiskInfo &disk) {
     if (disk.isNull()) {
         qWarning() << "invalid disk" << disk;
@@ -497,8 +3686,10 @@ bool KDiskManager::unmount(const KDiskInfo &disk) {
     }
 
     qDebug() << "unmounting" << disk;
+    KDiskMetricTimer timer(s_unmountseconds);
     const int rv = ::umount2(mountdir.constData(), MNT_DETACH);
     if (rv != 0) {
+        s_unmountfailures.add();
         qWarning() << qt_error_string(errno);
         return false;
     }
@@ -506,49 +3697,458 @@ bool KDiskManager::unmount(const KDiskInfo &disk) {
     return true;
 }
 
-bool KDiskManager::mkfs(const KDiskInfo &disk, const QString &fstype) {
+bool KDiskManager::mkfs(const KDiskInfo &disk, const QString &fstype, const bool discard) {
+    return execJob(mkfsJob(disk, fstype, discard));
+}
+
+KDiskJob* KDiskManager::mkfsJob(const KDiskInfo &disk, const QString &fstype, const bool discard) {
+    QList<QStringList> commands;
     if (disk.isNull()) {
-        qWarning() << "invalid disk" << disk;
-        return false;
+        return instrumentJob(new KDiskJob(commands, "invalid disk " + disk.name),
+            &s_mkfsseconds, &s_mkfsfailures);
     } else if (!supported().contains(fstype)) {
-        qWarning() << "invalid filesystem type" << fstype;
-        return false;
+        return instrumentJob(new KDiskJob(commands, "invalid filesystem type " + fstype),
+            &s_mkfsseconds, &s_mkfsfailures);
     }
 
     if (mounted(disk.name)) {
-        qWarning() << "device is mounted" << disk;
-        return false;
+        return instrumentJob(new KDiskJob(commands, "device is mounted " + disk.name),
+            &s_mkfsseconds, &s_mkfsfailures);
     }
 
     qDebug() << "formatting" << disk;
+    if (discard && discardSupported(disk.name)) {
+        /*
+            blkdiscard is part of util-linux and may be missing, the device is then discarded by a step
+            of the job in-process. Discarding a gigabyte at a time keeps the device responsive meanwhile
+        */
+        const QString blkdiscard = QStandardPaths::findExecutable("blkdiscard");
+        if (!blkdiscard.isEmpty()) {
+            commands << (QStringList() << blkdiscard << "--step" << "1G" << disk.name);
+        } else {
+            commands << (QStringList() << s_discardstep << disk.name);
+        }
+    }
     QString program = "mkfs." + fstype;
     if (fstype == "swap") {
         program = "mkswap";
     }
-    QProcess mkfsproc;
-    mkfsproc.start(program, QStringList() << disk.name);
-    mkfsproc.waitForStarted(-1);
-    while (mkfsproc.state() == QProcess::Running) {
-        QCoreApplication::processEvents();
+    commands << (QStringList() << program << disk.name);
+    return instrumentJob(new KDiskJob(commands), &s_mkfsseconds, &s_mkfsfailures);
+}
+
+bool KDiskManager::trim(const KDiskInfo &disk) {
+    if (disk.isNull()) {
+        qWarning() << "invalid disk" << disk;
+        return false;
+    }
+
+    if (!discardSupported(disk.name)) {
+        qWarning() << "device does not support discard" << disk;
+        return false;
+    }
+
+    const QByteArray directory = mountpoint(disk.name).toUtf8();
+    if (directory.isEmpty()) {
+        qWarning() << "device is not mounted" << disk;
+        return false;
+    }
+
+    qDebug() << "trimming" << disk;
+    const qint64 trimmed = trimRange(directory, 0, Q_UINT64_C(0xFFFFFFFFFFFFFFFF));
+    if (trimmed < 0) {
+        return false;
+    }
+    qDebug() << "trimmed" << trimmed << "bytes of" << disk.name;
+
+    return true;
+}
+
+bool KDiskManager::discard(const KDiskInfo &disk) {
+    if (disk.isNull()) {
+        qWarning() << "invalid disk" << disk;
+        return false;
+    }
+
+    if (mounted(disk.name)) {
+        qWarning() << "device is mounted" << disk;
+        return false;
     }
-    if (mkfsproc.exitCode() != 0) {
-        qWarning() << mkfsproc.readAllStandardError();
+
+    const int fd = ::open(disk.name.constData(), O_WRONLY | O_CLOEXEC | O_EXCL);
+    if (fd == -1) {
+        qWarning() << "could not open" << disk.name << qt_error_string(errno);
+        return false;
+    }
+
+    quint64 range[2] = { 0, 0 };
+    if (::ioctl(fd, BLKGETSIZE64, &range[1]) != 0 || ::ioctl(fd, BLKDISCARD, range) != 0) {
+        qWarning() << "could not discard" << disk.name << qt_error_string(errno);
+        ::close(fd);
         return false;
     }
+    ::close(fd);
 
     return true;
 }
 
-bool KDiskManager::userMount(const KDiskInfo &disk) {
+void KDiskManager::setTrimSchedule(const int interval, const qint64 chunk, const int pause) {
+    diskManager()->setTrimSchedule(interval, chunk, pause);
+}
+
+int KDiskManager::trimInterval() {
+    const QTimer *timer = diskManager()->m_trimtimer;
+    return timer->isActive() ? timer->interval() : 0;
+}
+
+bool KDiskManager::userMount(const KDiskInfo &disk, const QString &options) {
     qDebug() << "user mounting" << disk.name;
 
-    return diskManager()->call("mount", disk.name);
+    if (!options.isEmpty()) {
+        return diskManager()->call("mountWithOptions", QStringList() << disk.name << options);
+    }
+    return diskManager()->call("mount", QStringList() << disk.name);
 }
 
 bool KDiskManager::userUnmount(const KDiskInfo &disk) {
     qDebug() << "user unmounting" << disk.name;
 
-    return diskManager()->call("unmount", disk.name);
+    return diskManager()->call("unmount", QStringList() << disk.name);
+}
+
+QDBusPendingReply<bool> KDiskManager::userMountAsync(const KDiskInfo &disk, const QString &options) {
+    qDebug() << "user mounting asynchronously" << disk.name;
+
+    if (!options.isEmpty()) {
+        return diskManager()->asyncCall("mountWithOptions", QStringList() << disk.name << options);
+    }
+    return diskManager()->asyncCall("mount", QStringList() << disk.name);
+}
+
+QDBusPendingReply<bool> KDiskManager::userUnmountAsync(const KDiskInfo &disk) {
+    qDebug() << "user unmounting asynchronously" << disk.name;
+
+    return diskManager()->asyncCall("unmount", QStringList() << disk.name);
+}
+
+QMap<QString, bool> KDiskManager::userMountAll(const QList<KDiskInfo> &disks) {
+    qDebug() << "user mounting" << disks.size() << "disks";
+
+    return diskManager()->callAll("mountMany", disks);
+}
+
+QMap<QString, bool> KDiskManager::userUnmountAll(const QList<KDiskInfo> &disks) {
+    qDebug() << "user unmounting" << disks.size() << "disks";
+
+    return diskManager()->callAll("unmountMany", disks);
+}
+
+void KDiskManager::setClientMode(const bool client) {
+    s_clientmode = client;
+}
+
+bool KDiskManager::clientMode() {
+    return s_clientmode;
+}
+
+void KDiskManager::setProbing(const bool probe) {
+    s_probing = probe;
+}
+
+bool KDiskManager::probing() {
+    return s_probing;
+}
+
+void KDiskManager::setQuietWindow(const int msecs) {
+    s_quietwindow = msecs;
+}
+
+int KDiskManager::quietWindow() {
+    return s_quietwindow;
+}
+
+quint64 KDiskManager::receivedEvents() {
+    return s_receivedevents.value();
+}
+
+quint64 KDiskManager::emittedEvents() {
+    return s_emittedevents.value();
+}
+
+void KDiskManager::setReceiveBuffer(const int bytes) {
+    s_receivebuffer = bytes;
+}
+
+int KDiskManager::receiveBuffer() {
+    return s_receivebuffer;
+}
+
+quint64 KDiskManager::resyncs() {
+    return s_resyncs.value();
+}
+
+QList<KDiskStats> KDiskManager::stats() {
+    return diskManager()->m_sampler.stats();
+}
+
+QList<KDiskStats> KDiskManager::history(const QString &disk) {
+    return diskManager()->m_sampler.history(disk.toUtf8());
+}
+
+void KDiskManager::setStatsInterval(const int msecs) {
+    QTimer *timer = diskManager()->m_statstimer;
+    if (msecs > 0) {
+        timer->start(msecs);
+        diskManager()->m_sampler.sample(disks());
+    } else {
+        timer->stop();
+    }
+}
+
+int KDiskManager::statsInterval() {
+    const QTimer *timer = diskManager()->m_statstimer;
+    return timer->isActive() ? timer->interval() : 0;
+}
+
+QList<KDiskUsage> KDiskManager::usage() {
+    KDiskManagerPrivate *manager = diskManager();
+    if (manager->m_usagetimer->isActive()) {
+        return manager->m_usage;
+    }
+
+    QList<KDiskUsage> result;
+    foreach (const KDiskMount &mount, manager->mounts()) {
+        KDiskUsage usage;
+        if (readUsage(mount, &usage)) {
+            result.append(usage);
+        }
+    }
+    return result;
+}
+
+void KDiskManager::setUsageInterval(const int msecs) {
+    QTimer *timer = diskManager()->m_usagetimer;
+    if (msecs > 0) {
+        timer->start(msecs);
+        diskManager()->collectUsage();
+    } else {
+        timer->stop();
+    }
+}
+
+int KDiskManager::usageInterval() {
+    const QTimer *timer = diskManager()->m_usagetimer;
+    return timer->isActive() ? timer->interval() : 0;
+}
+
+void KDiskManager::setUsageThresholds(const QList<int> &thresholds) {
+    diskManager()->m_usagethresholds = thresholds;
+}
+
+QList<int> KDiskManager::usageThresholds() {
+    return diskManager()->m_usagethresholds;
+}
+
+QString KDiskManager::queueParameter(const QString &disk, const QString &parameter) {
+    if (!s_queueparameters.contains(parameter)) {
+        qWarning() << "invalid queue parameter" << parameter;
+        return QString();
+    }
+
+    const QString path = queueDirectory(disk) + "/queue/" + parameter;
+    QString result = readSysfs(path);
+    if (parameter == "scheduler") {
+        // the active scheduler is the one in brackets, e.g. "mq-deadline [none]"
+        const int start = result.indexOf('[');
+        const int end = result.indexOf(']', start);
+        if (start >= 0 && end > start) {
+            result = result.mid(start + 1, end - start - 1);
+        }
+    }
+    return result;
+}
+
+bool KDiskManager::setQueueParameter(const QString &disk, const QString &parameter, const QString &value) {
+    if (!s_queueparameters.contains(parameter)) {
+        qWarning() << "invalid queue parameter" << parameter;
+        return false;
+    }
+
+    const QString path = queueDirectory(disk) + "/queue/" + parameter;
+    QFile file(path);
+    if (!file.open(QFile::WriteOnly)) {
+        qWarning() << "could not open queue parameter" << path << file.errorString();
+        return false;
+    }
+    const QByteArray data = value.toUtf8();
+    if (file.write(data) != data.size()) {
+        qWarning() << "could not set queue parameter" << path << "to" << value << file.errorString();
+        return false;
+    }
+    file.close();
+
+    return true;
+}
+
+bool KDiskManager::setQueueProfiles(const QStringList &rules) {
+    bool result = true;
+    QList<KDiskQueueRule> queuerules;
+    foreach (const QString &rule, rules) {
+        const QString trimmed = rule.trimmed();
+        if (trimmed.isEmpty() || trimmed.startsWith('#')) {
+            continue;
+        }
+
+        const int separator = trimmed.indexOf(':');
+        if (separator < 0) {
+            qWarning() << "invalid queue rule" << rule;
+            result = false;
+            continue;
+        }
+
+        KDiskQueueRule queuerule;
+        bool valid = true;
+        const QStringList criteria = trimmed.left(separator).split(' ', QString::SkipEmptyParts);
+        foreach (const QString &criterion, criteria) {
+            const int equal = criterion.indexOf('=');
+            const QString key = criterion.left(equal);
+            if (equal < 1 || !s_queuecriteria.contains(key)) {
+                valid = false;
+                break;
+            }
+            queuerule.criteria.append(qMakePair(key, criterion.mid(equal + 1)));
+        }
+        const QStringList settings = trimmed.mid(separator + 1).split(' ', QString::SkipEmptyParts);
+        foreach (const QString &setting, settings) {
+            const int equal = setting.indexOf('=');
+            const QString key = setting.left(equal);
+            if (equal < 1 || !s_queueparameters.contains(key)) {
+                valid = false;
+                break;
+            }
+            queuerule.settings.append(qMakePair(key, setting.mid(equal + 1)));
+        }
+        if (!valid || queuerule.settings.isEmpty()) {
+            qWarning() << "invalid queue rule" << rule;
+            result = false;
+            continue;
+        }
+        queuerules.append(queuerule);
+    }
+
+    diskManager()->m_queuerules = queuerules;
+    if (queuerules.isEmpty()) {
+        return result;
+    }
+
+    // the disks present now are tuned right away, new ones when they are added
+    const QDir dir(s_systemroot + "/sys/block");
+    foreach (const QString &entry, dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        diskManager()->applyQueueRules(entry);
+    }
+    return result;
+}
+
+void KDiskManager::setSnapshot(const QString &path) {
+    s_snapshot = path;
+}
+
+// formats microseconds as seconds, the base unit of Prometheus
+static QByteArray metricSeconds(const qint64 usecs) {
+    return QByteArray::number(double(usecs) / 1000000.0, 'g', 12);
+}
+
+static QByteArray metricLabels(const char *labels, const QByteArray &extra = QByteArray()) {
+    QByteArray result(labels);
+    if (!extra.isEmpty()) {
+        if (!result.isEmpty()) {
+            result += ',';
+        }
+        result += extra;
+    }
+    if (result.isEmpty()) {
+        return result;
+    }
+    return '{' + result + '}';
+}
+
+QByteArray KDiskManager::metrics() {
+    // metrics sharing name are grouped under one HELP and TYPE header
+    QMap<QByteArray, QList<const KDiskMetric*> > grouped;
+    for (const KDiskMetric *metric = s_metrics.load(); metric; metric = metric->m_next) {
+        grouped[metric->m_name].prepend(metric);
+    }
+
+    QByteArray result;
+    QMap<QByteArray, QList<const KDiskMetric*> >::const_iterator it = grouped.constBegin();
+    while (it != grouped.constEnd()) {
+        const QByteArray &name = it.key();
+        const KDiskMetric *first = it.value().first();
+        static const char* const typenames[] = { "counter", "gauge", "histogram" };
+        result += "# HELP " + name + ' ' + first->m_help + '\n';
+        result += "# TYPE " + name + ' ' + typenames[first->m_type] + '\n';
+        foreach (const KDiskMetric *metric, it.value()) {
+            if (metric->m_type != KDiskMetric::Histogram) {
+                result += name + metricLabels(metric->m_labels) + ' '
+                    + QByteArray::number(metric->value()) + '\n';
+                continue;
+            }
+
+            qint64 cumulative = 0;
+            for (int i = 0; i < KDiskMetric::BucketCount; i++) {
+                cumulative += metric->m_buckets[i].load(std::memory_order_relaxed);
+                const QByteArray bound = (i < KDiskMetric::BucketCount - 1)
+                    ? metricSeconds(s_metricbuckets[i]) : QByteArray("+Inf");
+                result += name + "_bucket" + metricLabels(metric->m_labels, "le=\"" + bound + '"')
+                    + ' ' + QByteArray::number(cumulative) + '\n';
+            }
+            result += name + "_sum" + metricLabels(metric->m_labels) + ' '
+                + metricSeconds(metric->m_sum.load(std::memory_order_relaxed)) + '\n';
+            result += name + "_count" + metricLabels(metric->m_labels) + ' '
+                + QByteArray::number(metric->value()) + '\n';
+        }
+        ++it;
+    }
+    return result;
+}
+
+void KDiskManager::setMetricsFile(const QString &path, const int msecs) {
+    s_metricsfile = path;
+    QTimer *timer = diskManager()->m_metricstimer;
+    if (!path.isEmpty() && msecs > 0) {
+        timer->start(msecs);
+    } else {
+        timer->stop();
+    }
+}
+
+QString KDiskManager::metricsFile() {
+    return s_metricsfile;
+}
+
+KDiskJob* KDiskManager::instrumentJob(KDiskJob *job, KDiskMetric *duration, KDiskMetric *failures) {
+    job->setMetrics(duration, failures);
+    return job;
+}
+
+void KDiskManager::setSystemRoot(const QString &root) {
+    s_systemroot = root;
+}
+
+QString KDiskManager::systemRoot() {
+    return s_systemroot;
+}
+
+void KDiskManager::setEventSource(const QString &path) {
+    s_eventsource = path;
+}
+
+QString KDiskManager::eventSource() {
+    return s_eventsource;
+}
+
+QString KDiskManager::snapshot() {
+    return s_snapshot;
 }
 
 void KDiskManager::emitAdded(const KDiskInfo &disk) {
@@ -4,16 +4,24 @@
 #include <QObject>
 #include <QString>
 #include <QStringList>
+#include <QMap>
 #include <QMetaType>
+#include <QProcess>
+#include <QElapsedTimer>
 #include <QDBusArgument>
+#include <QDBusPendingReply>
+
+#include <atomic>
 
 /*!
     Disk information holder, valid object is obtained via @p KDiskManager::info. If the device
     does not have a name, UUID or type it is not considered valid. Label and size are optional.
-    The size of the device is in Kilobytes
+    The size of the device is in Kilobytes and saturates at 2 TiB, @p bytes holds the full size.
+    The topology fields are in bytes, as reported by the kernel
 
     @note It is up to the programmer to keep the integrity of the structure
-    @note D-Bus signature for the type is <b>(ssssii)</b>
+    @note D-Bus signature for the type is <b>(ssssii)</b>, see @p KDiskInfoV2 for the extended
+    signature
     @ingroup Types
 
     @see KDiskManager
@@ -30,6 +38,7 @@ class KDiskInfo {
 
         KDiskInfo();
         KDiskInfo(const KDiskInfo &info);
+        KDiskInfo(KDiskInfo &&info);
 
         QByteArray name;
         QByteArray label;
@@ -37,6 +46,13 @@ class KDiskInfo {
         QByteArray fsuuid;
         int size;
         KDiskType type;
+        qint64 bytes;
+        int logicalblocksize;
+        int physicalblocksize;
+        int minimumio;
+        int optimalio;
+        int alignmentoffset;
+        bool rotational;
 
         //! @brief Fancy name for the purpose of widgets
         QString fancyName() const;
@@ -50,6 +66,7 @@ class KDiskInfo {
 
         bool operator==(const KDiskInfo &i) const;
         KDiskInfo &operator=(const KDiskInfo &i);
+        KDiskInfo &operator=(KDiskInfo &&i);
 };
 #ifndef QT_NO_DEBUG_STREAM
 QDebug operator<<(QDebug, const KDiskInfo &);
@@ -57,6 +74,252 @@ QDebug operator<<(QDebug, const KDiskInfo &);
 const QDBusArgument &operator<<(QDBusArgument &, const KDiskInfo &);
 const QDBusArgument &operator>>(const QDBusArgument &, KDiskInfo &);
 
+/*!
+    Version 2 of the disk information D-Bus type, it carries the byte size and the topology
+    fields of @p KDiskInfo in addition to the version 1 fields
+
+    @note D-Bus signature for the type is <b>(ssssiixiiiiib)</b>
+    @ingroup Types
+
+    @see KDiskInfo
+*/
+class KDiskInfoV2 {
+
+    public:
+        KDiskInfoV2();
+        KDiskInfoV2(const KDiskInfo &info);
+
+        KDiskInfo info;
+};
+const QDBusArgument &operator<<(QDBusArgument &, const KDiskInfoV2 &);
+const QDBusArgument &operator>>(const QDBusArgument &, KDiskInfoV2 &);
+
+/*!
+    Disk I/O statistics holder, obtained via @p KDiskManager::stats. The rates are averages over
+    the sampling interval ending at the timestamp, which is in milliseconds since the epoch
+
+    @note D-Bus signature for the type is <b>(sxdddddd)</b>
+    @ingroup Types
+
+    @see KDiskManager
+*/
+class KDiskStats {
+
+    public:
+        KDiskStats();
+
+        QByteArray name;
+        qint64 timestamp;
+        //! @brief Read operations per second
+        double readiops;
+        //! @brief Write operations per second
+        double writeiops;
+        //! @brief Read bytes per second
+        double readbytes;
+        //! @brief Written bytes per second
+        double writebytes;
+        //! @brief Average number of operations in flight
+        double queuedepth;
+        //! @brief Percentage of time the device was busy
+        double utilization;
+};
+#ifndef QT_NO_DEBUG_STREAM
+QDebug operator<<(QDebug, const KDiskStats &);
+#endif
+const QDBusArgument &operator<<(QDBusArgument &, const KDiskStats &);
+const QDBusArgument &operator>>(const QDBusArgument &, KDiskStats &);
+
+/*!
+    Filesystem usage holder of mounted disk, obtained via @p KDiskManager::usage. The sizes are in
+    bytes and the timestamp is in milliseconds since the epoch
+
+    @note D-Bus signature for the type is <b>(ssxxxxxx)</b>
+    @ingroup Types
+
+    @see KDiskManager
+*/
+class KDiskUsage {
+
+    public:
+        KDiskUsage();
+
+        //! @brief Returns the percentage of used space, rounded up the same as df does
+        int percent() const;
+
+        QByteArray name;
+        QByteArray mountpoint;
+        qint64 timestamp;
+        //! @brief Size of the filesystem
+        qint64 size;
+        //! @brief Used space, including the space reserved for the superuser
+        qint64 used;
+        //! @brief Space available to unprivileged users
+        qint64 available;
+        //! @brief Number of inodes
+        qint64 files;
+        //! @brief Number of free inodes
+        qint64 freefiles;
+};
+#ifndef QT_NO_DEBUG_STREAM
+QDebug operator<<(QDebug, const KDiskUsage &);
+#endif
+const QDBusArgument &operator<<(QDBusArgument &, const KDiskUsage &);
+const QDBusArgument &operator>>(const QDBusArgument &, KDiskUsage &);
+
+/*!
+    Counter, gauge or latency histogram exported by @p KDiskManager::metrics in the Prometheus
+    text format. Metrics register themselves when constructed and are meant to have static
+    storage duration, updating them is lock-free. Metrics with the same name must have the same
+    type and differ by labels, e.g. <tt>method="info"</tt>
+
+    @ingroup Types
+
+    @see KDiskMetricTimer
+*/
+class KDiskMetric {
+
+    public:
+        enum KMetricType {
+            Counter = 0,
+            Gauge = 1,
+            Histogram = 2,
+        };
+
+        KDiskMetric(const char *name, const char *help, const KMetricType type,
+                    const char *labels = Q_NULLPTR);
+
+        //! @brief Adds value to counter or gauge
+        void add(const qint64 value = 1);
+        //! @brief Sets value of gauge
+        void set(const qint64 value);
+        //! @brief Records duration in microseconds in histogram
+        void observe(const qint64 usecs);
+        //! @brief Returns value of counter or gauge, number of observations of histogram
+        qint64 value() const;
+
+    private:
+        friend class KDiskManager;
+        Q_DISABLE_COPY(KDiskMetric);
+
+        // upper bounds of the histogram buckets in microseconds, the last one is infinite
+        static const int BucketCount = 14;
+
+        const char *m_name;
+        const char *m_help;
+        const char *m_labels;
+        KMetricType m_type;
+        std::atomic<qint64> m_value;
+        std::atomic<qint64> m_sum;
+        std::atomic<qint64> m_buckets[BucketCount];
+        KDiskMetric *m_next;
+};
+
+/*!
+    Records the time from construction to destruction in histogram
+
+    @ingroup Types
+
+    @see KDiskMetric
+*/
+class KDiskMetricTimer {
+
+    public:
+        KDiskMetricTimer(KDiskMetric &metric);
+        ~KDiskMetricTimer();
+
+    private:
+        Q_DISABLE_COPY(KDiskMetricTimer);
+
+        KDiskMetric &m_metric;
+        QElapsedTimer m_timer;
+};
+
+class KDiskDiscarder;
+
+/*!
+    Asynchronous disk operation, obtained via @p KDiskManager::fsckJob, @p KDiskManager::mkfsJob
+    or @p KDiskManager::rescanJob. The job starts once control returns to the event loop so that
+    signals can be connected right after it is created. By default the job deletes itself after
+    @p finished is emitted.
+
+    @see KDiskManager
+*/
+class KDiskJob : public QObject {
+    Q_OBJECT
+
+    public:
+        ~KDiskJob();
+
+        //! @brief Returns if the job is finished or not
+        bool isFinished() const;
+        //! @brief Returns if the job succeeded, valid only once finished
+        bool result() const;
+        //! @brief Returns description of the error, empty string if there was no error
+        QString errorString() const;
+        //! @brief Returns the overall progress of the job in percents
+        int percent() const;
+        /*!
+            @brief Returns estimated number of seconds until the job is finished, -1 if
+            unknown
+        */
+        int eta() const;
+        /*!
+            @brief Returns the most recent output of the job commands
+            @note The output is bounded, older output is discarded
+        */
+        QByteArray output() const;
+
+        //! @brief Returns if the job deletes itself once finished
+        bool autoDelete() const;
+        //! @brief Sets if the job deletes itself once finished
+        void setAutoDelete(const bool autodelete);
+
+    Q_SIGNALS:
+        //! @brief Signals progress of the job in percents
+        void progress(int percent);
+        //! @brief Signals the job failed
+        void error(const QString &message);
+        //! @brief Signals the job is finished, always emitted after @p error
+        void finished(bool result);
+
+    private Q_SLOTS:
+        void start();
+        void processFinished(int exitcode, QProcess::ExitStatus exitstatus);
+        void processError(QProcess::ProcessError error);
+        void processOutput();
+        void processErrorOutput();
+        void discardProgress(int percent);
+        void discardFinished();
+
+    private:
+        friend class KDiskManager;
+        KDiskJob(const QList<QStringList> &commands, const QString &error = QString());
+        Q_DISABLE_COPY(KDiskJob);
+
+        void next();
+        void finish(const bool result);
+        void parseProgress(const QByteArray &line);
+        void setStepProgress(const int percent);
+        void setMetrics(KDiskMetric *duration, KDiskMetric *failures);
+
+        QList<QStringList> m_commands;
+        int m_step;
+        QProcess *m_process;
+        // in-process discard step, when blkdiscard is not available
+        KDiskDiscarder *m_discarder;
+        QByteArray m_output;
+        QByteArray m_errors;
+        QByteArray m_partial;
+        int m_percent;
+        QElapsedTimer m_timer;
+        KDiskMetric *m_durationmetric;
+        KDiskMetric *m_failuremetric;
+        QString m_error;
+        bool m_finished;
+        bool m_result;
+        bool m_autodelete;
+};
+
 /*!
     Block device (disk) manager, operates mostly with device names e.g. /dev/sda1 and disk
     information type
@@ -69,34 +332,262 @@ class KDiskManager : public QObject {
     Q_OBJECT
 
     public:
+        enum KDiskCapability {
+            NoCapability = 0,
+            CanMkfs = 1,
+            CanFsck = 2,
+            CanGrow = 4,
+            CanDiscard = 8,
+        };
+
         KDiskManager(QObject *parent = Q_NULLPTR);
 
         //! @brief Returns supported filesystem fsck/mkfs types
         static QStringList supported();
+        /*!
+            @brief Returns bitwise OR of @p KDiskCapability values for each known filesystem type
+            @note The tools are looked up once and again only after the PATH directories change
+        */
+        static QMap<QString, int> capabilities();
         //! @brief Returns the information for all valid disks
         static QList<KDiskInfo> disks();
         //! @brief Returns the information for disk
         static KDiskInfo info(const QString &disk);
+        /*!
+            @brief Returns the information for disks, in the same order
+            @note In client mode the disks not tracked are queried from the daemon in one call
+        */
+        static QList<KDiskInfo> infoAll(const QStringList &disks);
+        //! @brief Returns the information for the tracked disk with UUID, null if not found
+        static KDiskInfo find(const QString &uuid);
+        //! @brief Returns the information for the tracked partitions of disk
+        static QList<KDiskInfo> children(const QString &disk);
+        //! @brief Returns the tracked disk the partition is on, empty string for whole disks
+        static QString parent(const QString &disk);
         //! @brief Returns if disk is mounted or not
         static bool mounted(const QString &disk);
         //! @brief Returns the mount point for disk, empty string if not mounted
         static QString mountpoint(const QString &disk);
+        //! @brief Returns the disk mounted on mount point, empty string if nothing is mounted
+        static QString device(const QString &mountpoint);
 
         //! @brief Scan for disk changes
         static bool rescan();
+        /*!
+            @brief Scan disks for changes in parallel, returns the result for each disk
+            @param concurrency maximum number of disks scanned at once, ideal thread count if 0
+            @note Disks sharing spindles are never scanned at the same time
+        */
+        static QMap<QString, bool> rescan(const QList<KDiskInfo> &disks, const int concurrency = 0);
+        //! @brief Scan for disk changes asynchronously
+        static KDiskJob* rescanJob();
+        //! @brief Scan disks for changes asynchronously, one after another
+        static KDiskJob* rescanJob(const QList<KDiskInfo> &disks);
         //! @brief Check disk
         static bool fsck(const KDiskInfo &disk);
-        //! @brief Mount disk, default mountpoint directory is <b>/mnt/\<uuid\></b>
-        static bool mount(const KDiskInfo &disk, const QString &directory = QString());
+        /*!
+            @brief Check disks in parallel, returns the result for each disk
+            @param concurrency maximum number of disks checked at once, ideal thread count if 0
+            @note Disks sharing spindles are never checked at the same time
+        */
+        static QMap<QString, bool> fsckAll(const QList<KDiskInfo> &disks, const int concurrency = 0);
+        //! @brief Check disk asynchronously
+        static KDiskJob* fsckJob(const KDiskInfo &disk);
+        /*!
+            @brief Mount disk, default mountpoint directory is <b>/mnt/\<uuid\></b>
+            @param options comma separated mount options, e.g. <b>noatime,commit=60</b>. The
+            <b>profile=\<name\></b> option expands to the options of the mount profile for the
+            filesystem type of disk, options after it take precedence
+            @note Safe to call from any thread, so are @p unmount, @p trim and @p setQueueParameter
+            @see mountProfiles
+        */
+        static bool mount(const KDiskInfo &disk, const QString &directory = QString(), const QString &options = QString());
+        //! @brief Returns the names of mount profiles for filesystem type
+        static QStringList mountProfiles(const QString &fstype);
+        //! @brief Returns the mount options of profile for filesystem type
+        static QString mountProfile(const QString &fstype, const QString &profile);
+        //! @brief Sets the mount options of profile for filesystem type, empty options remove it
+        static void setMountProfile(const QString &fstype, const QString &profile, const QString &options);
         //! @brief Unmount disk
         static bool unmount(const KDiskInfo &disk);
-        //! @brief Format disk
-        static bool mkfs(const KDiskInfo &disk, const QString &fstype);
+        /*!
+            @brief Mount filesystem image through a loop device, returns the loop device or empty
+            string on failure. The loop device uses direct I/O with the logical block size of the
+            device backing the image and is detached once the filesystem is unmounted
+            @param options same as for @p mount, <b>ro</b> attaches the image read-only too
+            @note Safe to call from any thread, requires Linux 5.8 or newer
+        */
+        static QString mountImage(const QString &path, const QString &options = QString());
+        /*!
+            @brief Mount disks in parallel to their default mountpoint directories, returns the
+            result for each disk
+            @param concurrency maximum number of disks mounted at once, ideal thread count if 0
+            @note The order in which disks are mounted is not defined
+        */
+        static QMap<QString, bool> mountAll(const QList<KDiskInfo> &disks, const QString &options = QString(), const int concurrency = 0);
+        //! @brief Unmount disks in parallel, returns the result for each disk
+        static QMap<QString, bool> unmountAll(const QList<KDiskInfo> &disks, const int concurrency = 0);
+        //! @brief Format disk, optionally discarding all blocks first
+        static bool mkfs(const KDiskInfo &disk, const QString &fstype, const bool discard = false);
+        /*!
+            @brief Format disk asynchronously, optionally discarding all blocks first
+            @note Discarding uses blkdiscard when available, the device is discarded in-process
+            otherwise. Either way it is a step of the job and done a gigabyte at a time
+        */
+        static KDiskJob* mkfsJob(const KDiskInfo &disk, const QString &fstype, const bool discard = false);
+        //! @brief Discard unused blocks of the filesystem on mounted disk
+        static bool trim(const KDiskInfo &disk);
+        //! @brief Discard all blocks of unmounted disk, the data on it is lost
+        static bool discard(const KDiskInfo &disk);
+        /*!
+            @brief Sets the interval in milliseconds at which all mounted disks that support
+            discard are trimmed, 0 disables it
+            @param chunk number of bytes trimmed at once, 0 for the whole filesystem
+            @param pause milliseconds to wait between chunks
+            @note Disks are trimmed one at a time to avoid latency spikes
+        */
+        static void setTrimSchedule(const int interval, const qint64 chunk, const int pause);
+        //! @brief Returns the interval in milliseconds at which disks are trimmed
+        static int trimInterval();
 
         //! @brief Mount disk, does not assume adminstration priviledges
-        static bool userMount(const KDiskInfo &disk);
+        static bool userMount(const KDiskInfo &disk, const QString &options = QString());
         //! @brief Unmount disk, does not assume adminstration priviledges
         static bool userUnmount(const KDiskInfo &disk);
+        //! @brief Mount disk without blocking, does not assume adminstration priviledges
+        static QDBusPendingReply<bool> userMountAsync(const KDiskInfo &disk, const QString &options = QString());
+        //! @brief Unmount disk without blocking, does not assume adminstration priviledges
+        static QDBusPendingReply<bool> userUnmountAsync(const KDiskInfo &disk);
+        //! @brief Mount disks with a single call to the daemon, returns the result for each disk
+        static QMap<QString, bool> userMountAll(const QList<KDiskInfo> &disks);
+        //! @brief Unmount disks with a single call to the daemon, returns the result for each disk
+        static QMap<QString, bool> userUnmountAll(const QList<KDiskInfo> &disks);
+
+        /*!
+            @brief Sets if disks are tracked by mirroring the kblockd daemon instead of udev
+            @note Must be called before any other method, client mode is meant for processes that
+            only observe disks or use @p userMount and @p userUnmount
+        */
+        static void setClientMode(const bool client);
+        //! @brief Returns if disks are tracked by mirroring the kblockd daemon
+        static bool clientMode();
+        /*!
+            @brief Sets for how long disk must not change before @p changed is signaled, 0 to
+            signal every change as soon as it happens
+            @note Default is 50 milliseconds, a burst of changes results in a single signal
+        */
+        static void setQuietWindow(const int msecs);
+        //! @brief Returns for how long disk must not change before @p changed is signaled
+        static int quietWindow();
+        /*!
+            @brief Sets if @p info and @p infoAll read the superblocks of devices when udev does
+            not know their filesystem yet, e.g. right after @p mkfs or hotplug before udevd has
+            probed them. The signals never wait for the devices to be read
+            @note Default is false, reading requires access to the device nodes. Probed
+            information is merged with the one from udev and cached until the device changes
+        */
+        static void setProbing(const bool probe);
+        //! @brief Returns if superblocks are read when udev does not know the filesystem
+        static bool probing();
+        //! @brief Returns the number of events received from udev
+        static quint64 receivedEvents();
+        //! @brief Returns the number of added, changed and removed signals emitted for events
+        static quint64 emittedEvents();
+        /*!
+            @brief Sets the size of the udev event buffer in bytes, 0 for the system default
+            @note Must be called before any other method, if the buffer overflows the tracked
+            disks are resynchronized with udev
+        */
+        static void setReceiveBuffer(const int bytes);
+        //! @brief Returns the size of the udev event buffer in bytes
+        static int receiveBuffer();
+        //! @brief Returns the number of resynchronizations due to lost events
+        static quint64 resyncs();
+
+        /*!
+            @brief Returns block queue parameter of disk, for partitions the queue of their disk
+            @note Supported parameters are scheduler, read_ahead_kb, nr_requests, max_sectors_kb
+            and rotational
+        */
+        static QString queueParameter(const QString &disk, const QString &parameter);
+        //! @brief Sets block queue parameter of disk, assumes adminstration priviledges
+        static bool setQueueParameter(const QString &disk, const QString &parameter, const QString &value);
+        /*!
+            @brief Sets rules for tuning the queue of disks, applied to present disks right away
+            and to new ones when they are added. Returns false if some rule is not valid
+            @note Rules are in the format <b>criteria : settings</b>, where criteria and settings
+            are space separated <b>key=value</b> pairs. Criteria keys are name (wildcard pattern
+            matched against the kernel name), rotational and removable, all criteria must match.
+            Settings keys are the queue parameters, e.g. <b>rotational=1 : scheduler=mq-deadline
+            read_ahead_kb=4096</b> or <b>name=nvme* : scheduler=none</b>. Lines starting with #
+            are ignored
+        */
+        static bool setQueueProfiles(const QStringList &rules);
+
+        //! @brief Returns the latest I/O statistics for all tracked disks
+        static QList<KDiskStats> stats();
+        //! @brief Returns the recent I/O statistics for disk, oldest first
+        static QList<KDiskStats> history(const QString &disk);
+        //! @brief Sets the I/O statistics sampling interval in milliseconds, 0 disables sampling
+        static void setStatsInterval(const int msecs);
+        //! @brief Returns the I/O statistics sampling interval in milliseconds
+        static int statsInterval();
+        /*!
+            @brief Returns the filesystem usage of all mounted tracked disks, the last collection
+            if usage is collected periodically and collected right away otherwise
+        */
+        static QList<KDiskUsage> usage();
+        /*!
+            @brief Sets the filesystem usage collection interval in milliseconds, 0 disables
+            collection
+            @note Collection happens in a background thread so that slow filesystems do not block
+        */
+        static void setUsageInterval(const int msecs);
+        //! @brief Returns the filesystem usage collection interval in milliseconds
+        static int usageInterval();
+        /*!
+            @brief Sets the fill levels, in percents, at which @p usageThreshold is signaled
+            @note Levels are checked only when usage is collected periodically
+        */
+        static void setUsageThresholds(const QList<int> &thresholds);
+        //! @brief Returns the fill levels at which @p usageThreshold is signaled
+        static QList<int> usageThresholds();
+        /*!
+            @brief Sets file where the tracked disks are persisted, empty string to disable
+            @note Must be called before any other method, disks are loaded from the snapshot at
+            startup and verified against udev in a background thread
+        */
+        static void setSnapshot(const QString &path);
+        //! @brief Returns file where the tracked disks are persisted
+        static QString snapshot();
+        /*!
+            @brief Sets directory prepended to the sysfs and procfs paths, empty string for the
+            live system
+            @note Must be called before any other method
+        */
+        static void setSystemRoot(const QString &root);
+        //! @brief Returns directory prepended to the sysfs and procfs paths
+        static QString systemRoot();
+        /*!
+            @brief Sets file with recorded events, in the format of
+            <tt>udevadm monitor --property</tt>, replayed instead of monitoring udev. Regular
+            file is replayed at startup, a pipe is followed for as long as the manager lives
+            @note Must be called before any other method, the parent disks are looked up in
+            sysfs under @p systemRoot
+        */
+        static void setEventSource(const QString &path);
+        //! @brief Returns file with recorded events, empty string if udev is monitored
+        static QString eventSource();
+        //! @brief Returns all metrics in the Prometheus text format
+        static QByteArray metrics();
+        /*!
+            @brief Sets file where the metrics are written to in the Prometheus text format every
+            @p msecs milliseconds, e.g. for the node exporter textfile collector. Empty path
+            disables it
+        */
+        static void setMetricsFile(const QString &path, const int msecs);
+        //! @brief Returns file where the metrics are written to
+        static QString metricsFile();
 
     Q_SIGNALS:
         //! @brief Signals a block device was added
@@ -105,14 +596,30 @@ class KDiskManager : public QObject {
         void changed(const KDiskInfo &disk);
         //! @brief Signals a block device was removed
         void removed(const KDiskInfo &disk);
+        //! @brief Signals something was mounted or unmounted
+        void mountsChanged();
+        /*!
+            @brief Signals the fill level of mounted disk crossed a threshold, up or down.
+            @p threshold is the highest threshold reached, 0 if below all of them
+        */
+        void usageThreshold(const KDiskUsage &usage, const int threshold);
 
     private Q_SLOTS:
         void emitAdded(const KDiskInfo &disk);
         void emitChanged(const KDiskInfo &disk);
         void emitRemoved(const KDiskInfo &disk);
+
+    private:
+        static KDiskJob* instrumentJob(KDiskJob *job, KDiskMetric *duration, KDiskMetric *failures);
 };
 
 Q_DECLARE_METATYPE(KDiskInfo);
 Q_DECLARE_METATYPE(QList<KDiskInfo>);
+Q_DECLARE_METATYPE(KDiskInfoV2);
+Q_DECLARE_METATYPE(QList<KDiskInfoV2>);
+Q_DECLARE_METATYPE(KDiskStats);
+Q_DECLARE_METATYPE(QList<KDiskStats>);
+Q_DECLARE_METATYPE(KDiskUsage);
+Q_DECLARE_METATYPE(QList<KDiskUsage>);
 
 #endif // KDISKMANAGER_H